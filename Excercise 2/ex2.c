@@ -1,17 +1,36 @@
+#define _GNU_SOURCE /* splice, tee, pipe2, close_range and F_SETPIPE_SZ */
 #include <stdio.h>
 #include <zconf.h>
 #include <sys/wait.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <limits.h>
 
 /* Util declarations */
 #define MAX_JOBS 512
-#define MAX_ARGS 20
-#define MAX_ARGS_LEN 512
-#define MAX_LINE MAX_ARGS*MAX_ARGS_LEN
+#define READ_SIZE 65536 /* Bytes of input read at once, scripts take few reads */
+#define ARENA_BLOCK 256
+#define ALIGN(size) (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
 #define PROMPT "prompt> "
 #define DELIMITER " \""
+#define NULL_DEVICE "/dev/null"
+#define HASH_SIZE 1024 /* Buckets of the pid hash, a power of two */
+#define NO_JOB -1
+#define NO_OPERATOR -1
+#define FILE_MODE 0644 /* Mode of the files redirected to */
+#define TEE "tee"
+#define TEE_SIZE 65536 /* Bytes the built-in tee moves at once */
+#define PATH_BUCKETS 256 /* Buckets of the command path cache, a power of two */
+
+extern char **environ;
 
 typedef enum state {
     foreground, background
@@ -20,90 +39,311 @@ typedef enum bool {
     false, true
 } bool;
 
-void parse_line(char **, char *);
+/* Operators of the command line, found by pointer so a quoted "|" stays a plain word. */
+char *operators[] = {"|", "<", ">", ">>", "2>"};
+enum operator {
+    PIPE, REDIRECT_IN, REDIRECT_OUT, APPEND_OUT, REDIRECT_ERR, NUM_OPERATORS
+};
+
+size_t parse_line(char **, char *);
+
+char *word_of(char *);
+
+int operator_of(const char *);
 
 state check_ampersand(char *);
 
+/* Memory of a job: its line and arguments are bump allocated from blocks freed all at once. */
+struct block {
+    struct block *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+struct arena {
+    struct block *blocks;
+};
+
+void *arena_alloc(struct arena *, size_t);
+
+void arena_reserve(struct arena *, size_t);
+
+void arena_free(struct arena *);
+
 /* Jobs handling */
 struct job_t {
     pid_t pid;               /* PID of the job */
-    int jid;                 /* ID of the job */
+    int jid;                 /* ID of a background job, 0 for a foreground one */
     state state;             /* state of the job */
-    char *cmd[MAX_ARGS];     /* command of the job */
-    char line[MAX_LINE];     /* line of the command */
+    char **cmd;              /* command of the job, NULL terminated */
+    char *line;              /* line of the command */
+    struct arena arena;      /* memory of cmd and line */
+    int next;                /* next live job, or next free slot */
+    int prev;                /* previous live job */
+    int hash_next;           /* next job in the same pid bucket */
 };
 
-struct job_t setup_job(char *);
+/* Table of jobs: slots come from a free list, live jobs are linked in the order they started
+ * and found by pid through a hash, so nothing scans all MAX_JOBS slots. */
+struct job_table {
+    struct job_t jobs[MAX_JOBS];
+    int free;                /* first free slot */
+    int head;                /* first live job */
+    int tail;                /* last live job */
+    int buckets[HASH_SIZE];  /* first job of every pid bucket */
+    int signal_fd;           /* SIGCHLD is blocked and read from here */
+    int next_jid;            /* ID the next background job gets */
+};
+
+void setup_job(struct job_t *, const char *);
+
+void init_jobs(struct job_table *);
+
+void kill_all(struct job_table *);
+
+void remove_job(struct job_table *, pid_t);
+
+bool add_job(struct job_table *, struct job_t *);
+
+size_t reap_children(struct job_table *, pid_t *, size_t);
+
+void wait_job(struct job_table *, pid_t *, size_t);
+
+char *read_line(struct job_table *, int);
+
+/* Pipelines */
+struct stage {
+    char **argv;             /* arguments of the stage, NULL terminated */
+    char *in;                /* file for stdin, NULL to keep it */
+    char *out;               /* file for stdout, NULL to keep it */
+    bool append;             /* whether out is appended to */
+    char *err;               /* file for stderr, NULL to keep it */
+};
+
+size_t split_stages(struct job_t *, struct stage **);
+
+pid_t spawn_stage(struct stage *, state, bool, int, int, pid_t *);
+
+pid_t fork_tee(struct stage *, state, bool, int, int, pid_t *);
+
+int redirect(int, const char *, int);
 
-void kill_all(struct job_t *);
+int tee_stream(char **);
 
-void remove_job(struct job_t *, struct job_t);
+bool write_all(int, const char *, size_t);
 
-void add_job(struct job_t *, struct job_t);
+bool read_all(int, char *, size_t);
+
+bool splice_all(int, int, size_t);
+
+/* Cache of the paths commands were found at in PATH, so a command is looked up once. */
+struct path_entry {
+    struct path_entry *next; /* next entry in the same bucket */
+    int hits;                /* times the path was used */
+    char *path;              /* absolute path of the command */
+    char name[];             /* command as typed */
+};
+
+struct path_cache {
+    struct path_entry *buckets[PATH_BUCKETS];
+    char *search_path;       /* PATH the entries were found in */
+};
+
+const char *resolve_command(const char *);
+
+void forget_command(const char *);
+
+void clear_commands(void);
 
 /* Commands */
-bool start(struct job_t *, struct job_t);
+bool start(struct job_table *, struct job_t *);
+
+bool execute(struct job_table *, struct job_t *);
 
-bool execute(struct job_t *, struct job_t);
+bool help(struct job_table *, struct job_t *);
 
-bool help(struct job_t *, struct job_t);
+bool cd(struct job_table *, struct job_t *);
 
-bool cd(struct job_t *, struct job_t);
+bool list_jobs(struct job_table *, struct job_t *);
 
-bool list_jobs(struct job_t *, struct job_t);
+bool shell_exit(struct job_table *, struct job_t *);
 
-bool shell_exit(struct job_t *, struct job_t);
+bool hash(struct job_table *, struct job_t *);
+
+bool wait_jobs(struct job_table *, struct job_t *);
 
 /* Implementations */
 /**
- * Main
- * @return 0
+ * Main. Reads commands from the script given as argument, or from stdin. The prompt is only
+ * printed when stdin is a terminal read interactively.
+ * @param argc number of arguments.
+ * @param argv arguments, the script to run.
+ * @return 0, 1 if the script can't be opened.
  */
-int main() {
-    bool status = true;
-    char line[MAX_LINE];
-    struct job_t jobs[MAX_JOBS];
+int main(int argc, char *argv[]) {
+    bool status = true, interactive;
+    int input = STDIN_FILENO;
+    char *line;
+    static struct job_table jobs;
     struct job_t job;
-    bzero(jobs, MAX_JOBS * sizeof(struct job_t *)); /* Initalize to all-zeros */
-    memset(line, '\0', MAX_LINE);
+    if (argc > 1 && (input = open(argv[1], O_RDONLY | O_CLOEXEC)) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    interactive = input == STDIN_FILENO && isatty(STDIN_FILENO) ? true : false;
+    init_jobs(&jobs);
     while (status == true) {
-        printf(PROMPT);
-        fgets(line, MAX_LINE * sizeof(char), stdin);
-        line[strlen(line) - 1] = '\0';
-        job = setup_job(line);
-        status = execute(jobs, job);
+        if (interactive == true)
+            printf(PROMPT);
+        if ((line = read_line(&jobs, input)) == NULL)
+            break;
+        setup_job(&job, line);
+        status = execute(&jobs, &job);
+        arena_free(&job.arena); /* Nothing left to free if the job table took it. */
     }
     return 0;
 }
 
 /**
- * Set up the job's parameters.
+ * Reads the next line of input without stdio, so children that exit while the shell waits for
+ * input are reaped right away, and before every line already in the buffer. Lines can be of any length, the buffer grows to hold them, and
+ * lines already read are only moved out of the way when more input is needed.
+ * @param jobs table of jobs.
+ * @param input descriptor to read from.
+ * @return the line without the new line, valid until the next call, NULL at the end of input.
+ */
+char *read_line(struct job_table *jobs, int input) {
+    static char *buffer = NULL;
+    static size_t start = 0, len = 0, capacity = 0;
+    struct pollfd fds[] = {{input, POLLIN, 0}, {jobs->signal_fd, POLLIN, 0}};
+    char *line, *end;
+    ssize_t num_bytes;
+
+    fflush(stdout);
+    for (;;) {
+        if (len > start && (end = memchr(buffer + start, '\n', len - start)) != NULL) {
+            reap_children(jobs, NULL, 0); /* A buffered line skips the poll, jobs that exited are reaped here. */
+            *end = '\0';
+            line = buffer + start;
+            start = end - buffer + 1;
+            return line;
+        }
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return NULL;
+        }
+        if (fds[1].revents)
+            reap_children(jobs, NULL, 0);
+        if (!fds[0].revents)
+            continue;
+        if (start > 0) { /* Drop the lines returned already. */
+            memmove(buffer, buffer + start, len - start);
+            len -= start;
+            start = 0;
+        }
+        if (capacity - len < READ_SIZE + 1) {
+            capacity = capacity ? 2 * capacity : 2 * READ_SIZE;
+            if ((buffer = realloc(buffer, capacity)) == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        num_bytes = read(input, buffer + len, READ_SIZE);
+        if (num_bytes < 0 && errno == EINTR)
+            continue;
+        if (num_bytes <= 0) { /* End of input, the last line may have no new line. */
+            if (len == start)
+                return NULL;
+            buffer[len] = '\0';
+            line = buffer + start;
+            start = len;
+            return line;
+        }
+        len += num_bytes;
+    }
+}
+
+/**
+ * Set up the job's parameters. The line and the arguments are copied to the job's arena, which
+ * is sized to the line up front so it takes a single allocation.
+ * @param job job to fill.
  * @param line intial line to start to job.
- * @return jobs with all fields filled.
  */
-struct job_t setup_job(char *line) {
-    struct job_t job;
-    static int jid = 1;
-    int i;
-    memset(&job, '\0', sizeof(job));
-    memcpy(job.line, line, MAX_LINE);
+void setup_job(struct job_t *job, const char *line) {
+    size_t len = strlen(line), argc;
+    char *words;
+    memset(job, '\0', sizeof(*job));
+
+    argc = parse_line(NULL, (char *) line);
+    arena_reserve(&job->arena, ALIGN((argc + 1) * sizeof(char *)) + 2 * ALIGN(len + 1));
+    job->cmd = arena_alloc(&job->arena, (argc + 1) * sizeof(char *));
+    job->line = arena_alloc(&job->arena, len + 1);
+    words = arena_alloc(&job->arena, len + 1);
+    memcpy(job->line, line, len + 1);
+    memcpy(words, line, len + 1);
+    parse_line(job->cmd, words);
+    job->cmd[argc] = NULL;
 
-    parse_line(job.cmd, line);
+    job->state = check_ampersand(job->line);
+    if (job->state == background) {
+        job->cmd[argc - 1] = NULL;
+        job->line[len - 1] = '\0';
+    }
+}
 
-    job.state = check_ampersand(job.line);
-    job.jid = jid++;
-    if (job.state == background) {
-        for (i = 0; job.cmd[i] != NULL; i++);
-        job.cmd[i - 1] = NULL;
-        job.line[strlen(job.line) - 1] = '\0';
+/**
+ * Allocates from an arena, in a new block if the last one is full.
+ * @param arena arena to allocate from.
+ * @param size number of bytes.
+ * @return the memory, aligned for pointers.
+ */
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct block *block = arena->blocks;
+    size = ALIGN(size);
+    if (block == NULL || block->size - block->used < size) {
+        arena_reserve(arena, size > ARENA_BLOCK ? size : ARENA_BLOCK);
+        block = arena->blocks;
+    }
+    block->used += size;
+    return block->data + block->used - size;
+}
+
+/**
+ * Starts a new block of exactly size bytes, for allocations whose total is known.
+ * @param arena arena to grow.
+ * @param size number of bytes.
+ */
+void arena_reserve(struct arena *arena, size_t size) {
+    struct block *block = malloc(sizeof(struct block) + size);
+    if (block == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    block->next = arena->blocks;
+    block->used = 0;
+    block->size = size;
+    arena->blocks = block;
+}
+
+/**
+ * Frees all the blocks of an arena.
+ * @param arena arena to free.
+ */
+void arena_free(struct arena *arena) {
+    struct block *block;
+    while ((block = arena->blocks) != NULL) {
+        arena->blocks = block->next;
+        free(block);
     }
-    return job;
 }
 
 /**
  * Separates line input to array of strings.
- * @param cmd where to put the args.
+ * @param cmd where to put the args, NULL to only count them (line is not changed then).
  * @param line input from user.
+ * @return number of args.
  */
 //void parse_line(char **cmd, char *line) {
 //    int i = 0;
@@ -115,15 +355,15 @@ struct job_t setup_job(char *line) {
 //    }
 //}
 
-void parse_line(char **cmd, char *line) {
-    char *p, *start_of_word;
+size_t parse_line(char **cmd, char *line) {
+    char *p, *start_of_word = NULL;
     int c;
     enum states {
         DULL, IN_WORD, IN_STRING
     } state = DULL;
     size_t position = 0;
 
-    for (p = line; position < MAX_ARGS && *p != '\0'; p++) {
+    for (p = line; *p != '\0'; p++) {
         c = (unsigned char) *p;
         switch (state) {
             case DULL:
@@ -143,31 +383,54 @@ void parse_line(char **cmd, char *line) {
 
             case IN_STRING:
                 if (c == '\"') {
-                    *p = 0;
-                    cmd[position++] = start_of_word;
+                    if (cmd != NULL) {
+                        *p = 0;
+                        cmd[position] = start_of_word;
+                    }
+                    position++;
                     state = DULL;
                 }
                 continue;
 
             case IN_WORD:
                 if (c == ' ') {
-                    *p = 0;
-                    cmd[position++] = start_of_word;
+                    if (cmd != NULL) {
+                        *p = 0;
+                        cmd[position] = word_of(start_of_word);
+                    }
+                    position++;
                     state = DULL;
                 }
                 continue;
         }
     }
 
-    if (state != DULL && position < MAX_ARGS)
-        cmd[position++] = start_of_word;
+    if (state != DULL) {
+        if (cmd != NULL)
+            cmd[position] = state == IN_WORD ? word_of(start_of_word) : start_of_word;
+        position++;
+    }
+    return position;
+}
+
+/**
+ * Finds an unquoted word in the operators.
+ * @param word word to check.
+ * @return the operator it is, the word itself if it isn't one.
+ */
+char *word_of(char *word) {
+    register int i;
+    for (i = 0; i < NUM_OPERATORS; i++)
+        if (!strcmp(word, operators[i]))
+            return operators[i];
+    return word;
 }
 
 /**
  * Function pointer for cleaner code.
  * @return true if success, false if fail.
  */
-bool (*func[])(struct job_t *, struct job_t) = {&cd, &help, &list_jobs, &shell_exit};
+bool (*func[])(struct job_table *, struct job_t *) = {&cd, &help, &list_jobs, &shell_exit, &hash, &wait_jobs};
 
 /**
  * Executes the custom functions and calls start to execute execvp.
@@ -175,15 +438,15 @@ bool (*func[])(struct job_t *, struct job_t) = {&cd, &help, &list_jobs, &shell_e
  * @param job job to execute.
  * @return true if success, false if fail.
  */
-bool execute(struct job_t *jobs, struct job_t job) {
-    if (job.cmd[0] == NULL) { return true; } /* Empty command. ask for another. */
+bool execute(struct job_table *jobs, struct job_t *job) {
+    if (job->cmd[0] == NULL) { return true; } /* Empty command. ask for another. */
     int i;
     size_t size;
-    char *commands[] = {"cd", "help", "jobs", "exit"};
+    char *commands[] = {"cd", "help", "jobs", "exit", "hash", "wait"};
 
     size = sizeof(commands) / sizeof(char *);
     for (i = 0; i < size; i++) {
-        if (!strcmp(job.cmd[0], commands[i])) {
+        if (!strcmp(job->cmd[0], commands[i])) {
             return (*func[i])(jobs, job);
         }
     }
@@ -196,54 +459,492 @@ bool execute(struct job_t *jobs, struct job_t job) {
  * @return background if command has ampersand, foreground otherwise.
  */
 inline state check_ampersand(char *line) {
-    return line[strlen(line) - 1] == '&' ? background : foreground;
+    size_t len = strlen(line);
+    return len > 0 && line[len - 1] == '&' ? background : foreground;
 }
 
 /**
- * Forks and executes a command with execvp.
- * @param jobs array of jobs.
+ * Starts a job, a pipeline of one or more stages. Every stage but the built-in tee is started
+ * with posix_spawn, which doesn't copy the shell's memory like fork does, and the stages are
+ * wired with pipes directly to each other. A background job gets a process group of its own for
+ * all its stages, and its first stage reads from /dev/null, since the shell has no job control to
+ * hand it the terminal. A foreground job stays in the shell's group. A background job isn't
+ * started when the table of jobs is full, since it couldn't be listed or waited for.
+ * @param jobs table of jobs.
  * @param job jobs to start.
  * @return true if success, false if fail.
  */
-bool start(struct job_t *jobs, struct job_t job) {
-    pid_t pid;
+bool start(struct job_table *jobs, struct job_t *job) {
+    struct stage *stages;
+    size_t num_stages, i;
+    pid_t *pids, pgid = 0;
+    int in = -1, out, fds[2];
+
+    if ((num_stages = split_stages(job, &stages)) == 0) {
+        fprintf(stderr, "Syntax error\n");
+        return true;
+    }
+    if (job->state == background && jobs->free == NO_JOB) { /* A foreground job is waited for anyway. */
+        fprintf(stderr, "Too many jobs\n");
+        return true;
+    }
+    if ((pids = calloc(num_stages, sizeof(pid_t))) == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < num_stages; i++) {
+        out = fds[0] = -1;
+        if (i + 1 < num_stages && pipe2(fds, O_CLOEXEC) == 0)
+            out = fds[1];
+        pids[i] = spawn_stage(&stages[i], job->state, i == 0, in, out, &pgid);
+        if (in >= 0)
+            close(in);
+        if (out >= 0)
+            close(out);
+        in = fds[0];
+    }
+    job->pid = pids[num_stages - 1]; /* The job ends with its last stage. */
+    if (job->pid > 0) {
+        add_job(jobs, job);
+        if (job->state == background)
+            printf("[%d] %d\n", job->jid, job->pid);
+        else
+            printf("%d\n", job->pid);
+    }
+    if (job->state == foreground)
+        wait_job(jobs, pids, num_stages);
+    free(pids);
+    return true;
+}
+
+/**
+ * Splits the job's arguments to pipeline stages at | and takes the redirections out of them.
+ * The stages and their arguments are allocated in the job's arena.
+ * @param job job to split.
+ * @param stages set to the stages.
+ * @return number of stages, 0 if a stage is empty or a redirection has no file.
+ */
+size_t split_stages(struct job_t *job, struct stage **stages) {
+    size_t argc, num = 1, i;
+    struct stage *stage;
+    char **args;
+    for (argc = 0; job->cmd[argc] != NULL; argc++)
+        num += job->cmd[argc] == operators[PIPE];
+    *stages = stage = arena_alloc(&job->arena, num * sizeof(struct stage));
+    args = arena_alloc(&job->arena, (argc + num) * sizeof(char *));
+    memset(stage, 0, num * sizeof(struct stage));
+    stage->argv = args;
+    for (i = 0; i <= argc; i++) {
+        char *word = job->cmd[i];
+        if (word == NULL || word == operators[PIPE]) {
+            if (args == stage->argv)
+                return 0;
+            *args++ = NULL;
+            if (word != NULL)
+                (++stage)->argv = args;
+        } else if (operator_of(word) != NO_OPERATOR) {
+            if (job->cmd[i + 1] == NULL || operator_of(job->cmd[i + 1]) != NO_OPERATOR)
+                return 0;
+            switch (operator_of(word)) {
+                case REDIRECT_IN:
+                    stage->in = job->cmd[++i];
+                    break;
+                case REDIRECT_ERR:
+                    stage->err = job->cmd[++i];
+                    break;
+                default:
+                    stage->out = job->cmd[++i];
+                    stage->append = word == operators[APPEND_OUT];
+            }
+        } else {
+            *args++ = word;
+        }
+    }
+    return num;
+}
+
+/**
+ * Finds which operator a word is. Only words that parse_line found unquoted point to operators.
+ * @param word word to check.
+ * @return the operator, NO_OPERATOR for a plain word.
+ */
+int operator_of(const char *word) {
     register int i;
+    for (i = 0; i < NUM_OPERATORS; i++)
+        if (word == operators[i])
+            return i;
+    return NO_OPERATOR;
+}
 
-    pid = fork();
+/**
+ * Starts a stage of a pipeline. Its stdin and stdout are the pipes to the stages next to it, or
+ * the files it redirects to, which win over the pipes. The command is started from the path
+ * cache.
+ * @param stage stage to start.
+ * @param state whether the job runs in the background.
+ * @param first whether it is the first stage.
+ * @param in read end of the pipe from the previous stage, -1 for none.
+ * @param out write end of the pipe to the next stage, -1 for none.
+ * @param pgid process group of a background job, 0 to make one of the stage.
+ * @return pid of the stage, 0 if it couldn't start.
+ */
+pid_t spawn_stage(struct stage *stage, state state, bool first, int in, int out, pid_t *pgid) {
+    pid_t pid;
+    int error = ENOENT;
+    const char *path;
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    sigset_t mask;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
 
-    if (pid > 0) { /* Forking successful, pid is child id. */
-        printf("%d\n", pid);
-        job.pid = pid;
-        add_job(jobs, job);
-    } else if (pid == 0) {
-        execvp(job.cmd[0], job.cmd);
+    if (!strcmp(stage->argv[0], TEE))
+        return fork_tee(stage, state, first, in, out, pgid);
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&actions);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    if (state == background) {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        posix_spawnattr_setpgroup(&attr, *pgid);
+        if (first)
+            posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, NULL_DEVICE, O_RDONLY, 0);
+    }
+    posix_spawnattr_setflags(&attr, flags);
+    if (in >= 0)
+        posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+    if (out >= 0)
+        posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    if (stage->in != NULL)
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, stage->in, O_RDONLY, 0);
+    if (stage->out != NULL)
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, stage->out,
+                                         O_WRONLY | O_CREAT | (stage->append ? O_APPEND : O_TRUNC), FILE_MODE);
+    if (stage->err != NULL)
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, stage->err, O_WRONLY | O_CREAT | O_TRUNC, FILE_MODE);
+    if ((path = resolve_command(stage->argv[0])) != NULL)
+        error = posix_spawn(&pid, path, &actions, &attr, stage->argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (error != 0) { /* Not found, not executable or a file can't be opened, the shell goes on. */
         fprintf(stderr, "Error in system call\n");
-    } else if (pid < 0) {
-        perror("Forking unsuccessful.\n");
-        return false;
+        return 0;
+    }
+    if (state == background && *pgid == 0)
+        *pgid = pid;
+    return pid;
+}
+
+/**
+ * Starts the built-in tee in a fork of the shell, wired like spawn_stage wires a command. Only
+ * stdin, stdout and stderr are left open in the fork.
+ * @return pid of the stage, 0 if it couldn't start.
+ */
+pid_t fork_tee(struct stage *stage, state state, bool first, int in, int out, pid_t *pgid) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error in system call\n");
+        return 0;
+    }
+    if (pid == 0) {
+        if (state == background)
+            setpgid(0, *pgid);
+        if (state == background && first && redirect(STDIN_FILENO, NULL_DEVICE, O_RDONLY) < 0)
+            _exit(1);
+        if ((in >= 0 && dup2(in, STDIN_FILENO) < 0) || (out >= 0 && dup2(out, STDOUT_FILENO) < 0)
+            || (stage->in != NULL && redirect(STDIN_FILENO, stage->in, O_RDONLY) < 0)
+            || (stage->out != NULL && redirect(STDOUT_FILENO, stage->out,
+                                               O_WRONLY | O_CREAT | (stage->append ? O_APPEND : O_TRUNC)) < 0)
+            || (stage->err != NULL && redirect(STDERR_FILENO, stage->err, O_WRONLY | O_CREAT | O_TRUNC) < 0)) {
+            fprintf(stderr, "Error in system call\n");
+            _exit(1);
+        }
+        /* The fork keeps every descriptor of the shell: the pipes once dup'd, the read end of the
+         * next stage's pipe, which would keep tee from seeing its reader exit, and the shell's own. */
+        close_range(STDERR_FILENO + 1, ~0U, 0);
+        _exit(tee_stream(stage->argv));
     }
-    if (job.state == foreground && pid != 0) {
-        waitpid(pid, NULL, 0);
-        remove_job(jobs, job);
+    if (state == background) {
+        setpgid(pid, *pgid); /* Either side may run first. */
+        if (*pgid == 0)
+            *pgid = pid;
+    }
+    return pid;
+}
+
+/**
+ * Opens a file on a descriptor.
+ * @param fd descriptor to open it on.
+ * @param path path of the file.
+ * @param flags flags of open.
+ * @return fd, -1 on failure.
+ */
+int redirect(int fd, const char *path, int flags) {
+    int file = open(path, flags, FILE_MODE);
+    if (file < 0)
+        return -1;
+    if (file != fd) {
+        dup2(file, fd);
+        close(file);
+    }
+    return fd;
+}
+
+/**
+ * Built-in tee [-a] file..., copies stdin to stdout and to every file. Between two pipes the data
+ * is not copied to user space: tee(2) duplicates it to stdout and to a spare pipe for every file
+ * but the last, and splice(2) moves it to the files, the last one taking it off stdin. If the
+ * spare pipe can't hold what went to stdout, the rest of it is read and written instead.
+ * @param argv arguments of tee.
+ * @return exit code.
+ */
+int tee_stream(char **argv) {
+    struct stat in_info, out_info;
+    int *files, num_files = 0, flags = O_WRONLY | O_CREAT | O_TRUNC, spare[2], i, last, chunk;
+    bool append = false;
+    ssize_t num_bytes, left;
+    char buffer[TEE_SIZE];
+
+    if (argv[1] != NULL && !strcmp(argv[1], "-a")) {
+        flags = O_WRONLY | O_CREAT; /* splice refuses O_APPEND, so the files are written from their end. */
+        append = true;
+        argv++;
+    }
+    for (i = 1; argv[i] != NULL; i++);
+    if ((files = malloc(i * sizeof(int))) == NULL)
+        return 1;
+    for (i = 1; argv[i] != NULL; i++)
+        if ((files[num_files] = open(argv[i], flags, FILE_MODE)) >= 0) {
+            if (append)
+                lseek(files[num_files], 0, SEEK_END);
+            num_files++;
+        } else
+            fprintf(stderr, "tee: can't open %s\n", argv[i]);
+    /* The last file takes the data off stdin, /dev/null if there are no files. */
+    if (num_files == 0 && (files[num_files++] = open(NULL_DEVICE, O_WRONLY)) < 0)
+        return 1;
+    last = num_files - 1;
+
+    if (fstat(STDIN_FILENO, &in_info) == 0 && S_ISFIFO(in_info.st_mode) && fstat(STDOUT_FILENO, &out_info) == 0
+        && S_ISFIFO(out_info.st_mode) && pipe(spare) == 0) {
+        /* Growing the pipe may be refused, then it stays at its size. */
+        if ((chunk = fcntl(spare[1], F_SETPIPE_SZ, TEE_SIZE)) < 0)
+            chunk = fcntl(spare[1], F_GETPIPE_SZ);
+        if (chunk > TEE_SIZE)
+            chunk = TEE_SIZE;
+        while (chunk > 0 && (num_bytes = tee(STDIN_FILENO, STDOUT_FILENO, chunk, 0)) != 0) {
+            if (num_bytes < 0 && errno == EINTR)
+                continue;
+            if (num_bytes < 0)
+                return 1;
+            /* tee always duplicates from the start of stdin, so a file that got less than num_bytes
+             * can't be given the rest the same way. */
+            for (i = 0, left = num_bytes; i < last && left == num_bytes; i++)
+                if ((left = tee(STDIN_FILENO, spare[1], num_bytes, 0)) < 0
+                    || splice_all(spare[0], files[i], left) == false)
+                    return 1;
+            if (left == num_bytes) {
+                if (splice_all(STDIN_FILENO, files[last], num_bytes) == false)
+                    return 1;
+                continue;
+            }
+            if (read_all(STDIN_FILENO, buffer, num_bytes) == false
+                || write_all(files[i - 1], buffer + left, num_bytes - left) == false)
+                return 1;
+            for (; i <= last; i++)
+                if (write_all(files[i], buffer, num_bytes) == false)
+                    return 1;
+        }
+        if (chunk > 0)
+            return 0;
+    }
+    while ((num_bytes = read(STDIN_FILENO, buffer, sizeof(buffer))) != 0) {
+        if (num_bytes < 0 && errno == EINTR)
+            continue;
+        if (num_bytes < 0 || write_all(STDOUT_FILENO, buffer, num_bytes) == false)
+            return 1;
+        for (i = 0; i < num_files; i++)
+            if (write_all(files[i], buffer, num_bytes) == false)
+                return 1;
+    }
+    return 0;
+}
+
+/**
+ * Reads exactly len bytes.
+ * @return true if read, false on failure or end of file.
+ */
+bool read_all(int fd, char *buffer, size_t len) {
+    ssize_t num_bytes;
+    while (len > 0) {
+        if ((num_bytes = read(fd, buffer, len)) <= 0) {
+            if (num_bytes < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        buffer += num_bytes;
+        len -= num_bytes;
     }
     return true;
 }
 
+/**
+ * Moves exactly len bytes from a pipe with splice.
+ * @return true if moved, false on failure.
+ */
+bool splice_all(int in, int out, size_t len) {
+    ssize_t num_bytes;
+    while (len > 0) {
+        if ((num_bytes = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE)) <= 0) {
+            if (num_bytes < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        len -= num_bytes;
+    }
+    return true;
+}
+
+/**
+ * Writes a whole buffer.
+ * @return true if written, false on failure.
+ */
+bool write_all(int fd, const char *buffer, size_t len) {
+    ssize_t num_bytes;
+    while (len > 0) {
+        if ((num_bytes = write(fd, buffer, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buffer += num_bytes;
+        len -= num_bytes;
+    }
+    return true;
+}
+
+/**
+ * Hashes a command name (FNV-1a).
+ * @param name name to hash.
+ * @return bucket of the name.
+ */
+size_t path_bucket(const char *name) {
+    size_t hash = 2166136261u;
+    for (; *name != '\0'; name++)
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    return hash & (PATH_BUCKETS - 1);
+}
+
+static struct path_cache path_cache;
+
+/**
+ * Finds the path of a command, in the cache or else by searching PATH like execvp does, without
+ * trying to execute every candidate. The cache is emptied when PATH changes, and a cached path
+ * that is no longer executable is looked up again. Commands with a
+ * slash are used as they are, and commands found in relative directories of PATH aren't cached,
+ * since they change with the working directory.
+ * @param name command to find.
+ * @return path of the command, valid until it is forgotten, NULL if it isn't found.
+ */
+const char *resolve_command(const char *name) {
+    static char found[PATH_MAX];
+    const char *search = getenv("PATH"), *dir, *end;
+    struct path_entry *entry, **bucket = &path_cache.buckets[path_bucket(name)];
+    struct stat info;
+    size_t name_len = strlen(name), dir_len;
+
+    if (strchr(name, '/') != NULL)
+        return name;
+    if (search == NULL)
+        search = "/bin:/usr/bin";
+    if (path_cache.search_path == NULL || strcmp(path_cache.search_path, search)) {
+        clear_commands();
+        if ((path_cache.search_path = strdup(search)) == NULL) {
+            perror("strdup");
+            exit(1);
+        }
+    }
+    for (entry = *bucket; entry != NULL; entry = entry->next)
+        if (!strcmp(entry->name, name)) {
+            if (access(entry->path, X_OK) == 0) {
+                entry->hits++;
+                return entry->path;
+            }
+            forget_command(name); /* Moved or removed since it was cached. */
+            break;
+        }
+    for (dir = search; ; dir = end + 1) {
+        end = strchrnul(dir, ':');
+        dir_len = end - dir;
+        if (dir_len == 0) /* An empty directory is the working directory. */
+            dir = ".", dir_len = 1;
+        if (dir_len + name_len + 2 <= sizeof(found)) {
+            memcpy(found, dir, dir_len);
+            found[dir_len] = '/';
+            memcpy(found + dir_len + 1, name, name_len + 1);
+            if (stat(found, &info) == 0 && S_ISREG(info.st_mode) && access(found, X_OK) == 0)
+                break;
+        }
+        if (*end == '\0')
+            return NULL;
+    }
+    if (found[0] != '/')
+        return found;
+    if ((entry = malloc(sizeof(struct path_entry) + name_len + 1 + strlen(found) + 1)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(entry->name, name, name_len + 1);
+    entry->path = strcpy(entry->name + name_len + 1, found);
+    entry->hits = 1;
+    entry->next = *bucket;
+    *bucket = entry;
+    return entry->path;
+}
+
+/**
+ * Removes a command from the path cache.
+ * @param name command to remove.
+ */
+void forget_command(const char *name) {
+    struct path_entry *entry, **link = &path_cache.buckets[path_bucket(name)];
+    for (; (entry = *link) != NULL; link = &entry->next)
+        if (!strcmp(entry->name, name)) {
+            *link = entry->next;
+            free(entry);
+            return;
+        }
+}
+
+/**
+ * Empties the path cache.
+ */
+void clear_commands(void) {
+    struct path_entry *entry;
+    register int i;
+    for (i = 0; i < PATH_BUCKETS; i++)
+        while ((entry = path_cache.buckets[i]) != NULL) {
+            path_cache.buckets[i] = entry->next;
+            free(entry);
+        }
+    free(path_cache.search_path);
+    path_cache.search_path = NULL;
+}
+
 /**
  * Change directory command.
  * @param jobs it's not oop so it's ok to force interface (unused).
  * @param job jobs to get the new directory.
  * @return true if success, false if fail.
  */
-bool cd(struct job_t *jobs, struct job_t job) {
+bool cd(struct job_table *jobs, struct job_t *job) {
     int success;
     static char prev_dir[1024] = "";
     printf("%d\n", getpid());
-    if (job.cmd[1] == NULL || !strcmp(job.cmd[1], "~")) {
+    if (job->cmd[1] == NULL || !strcmp(job->cmd[1], "~")) {
         getcwd(prev_dir, sizeof(prev_dir));
         success = chdir(getenv("HOME"));
         return true;
-    } else if (!strcmp(job.cmd[1], "-")) {
+    } else if (!strcmp(job->cmd[1], "-")) {
         char pwd[1024];
         getcwd(pwd, sizeof(prev_dir));
         success = chdir(prev_dir);
@@ -253,8 +954,8 @@ bool cd(struct job_t *jobs, struct job_t job) {
         return true;
     } else {
         getcwd(prev_dir, sizeof(prev_dir));
-        if (chdir(job.cmd[1]) == -1) {
-            fprintf(stderr, "No such directory %s\n", job.cmd[1]);
+        if (chdir(job->cmd[1]) == -1) {
+            fprintf(stderr, "No such directory %s\n", job->cmd[1]);
             return true;
         }
     }
@@ -267,7 +968,7 @@ bool cd(struct job_t *jobs, struct job_t job) {
  * @param job it's not oop so it's ok to force interface (unused).
  * @return true if success, false if fail.
  */
-bool help(struct job_t *jobs, struct job_t job) {
+bool help(struct job_table *jobs, struct job_t *job) {
     printf("***************************************************\n"
                    "***************************************************\n"
                    "****                                           ****\n"
@@ -287,69 +988,217 @@ bool help(struct job_t *jobs, struct job_t job) {
  * @param job it's not oop so it's ok to force interface (unused).
  * @return true if success, false if fail.
  */
-bool shell_exit(struct job_t *jobs, struct job_t job) {
+bool shell_exit(struct job_table *jobs, struct job_t *job) {
     kill_all(jobs);
     return false;
 }
 
 /**
- * Jobs command.
- * @param jobs array of jobs.
+ * Jobs command, lists the live background jobs in the order they started, with the ID wait takes
+ * as %ID.
+ * @param jobs table of jobs.
  * @param job it's not oop so it's ok to force interface (unused).
  * @return true if success, false if fail.
  */
-bool list_jobs(struct job_t *jobs, struct job_t job) {
+bool list_jobs(struct job_table *jobs, struct job_t *job) {
     register int i;
-    int status;
-    for (i = 0; i < MAX_JOBS; i++) {
-        if (jobs[i].pid != 0 && waitpid(jobs[i].pid, &status, WNOHANG) == 0) {
-            printf("%d %s\n", jobs[i].pid, jobs[i].line);
-        } else if (jobs[i].pid != 0 && waitpid(jobs[i].pid, &status, WNOHANG) != 0) {
-            remove_job(jobs, jobs[i]);
-        }
+    reap_children(jobs, NULL, 0);
+    for (i = jobs->head; i != NO_JOB; i = jobs->jobs[i].next)
+        if (jobs->jobs[i].state == background)
+            printf("[%d] %d %s\n", jobs->jobs[i].jid, jobs->jobs[i].pid, jobs->jobs[i].line);
+    return true;
+}
+
+/**
+ * Hash command. With no arguments lists the cached commands as hits and path, -r empties the
+ * cache, and names are looked up and cached.
+ * @param jobs it's not oop so it's ok to force interface (unused).
+ * @param job job with the arguments.
+ * @return true if success, false if fail.
+ */
+bool hash(struct job_table *jobs, struct job_t *job) {
+    struct path_entry *entry;
+    register int i;
+    if (job->cmd[1] == NULL) {
+        for (i = 0; i < PATH_BUCKETS; i++)
+            for (entry = path_cache.buckets[i]; entry != NULL; entry = entry->next)
+                printf("%d %s\n", entry->hits, entry->path);
+        return true;
+    }
+    for (i = 1; job->cmd[i] != NULL; i++) {
+        if (!strcmp(job->cmd[i], "-r"))
+            clear_commands();
+        else if (resolve_command(job->cmd[i]) == NULL)
+            fprintf(stderr, "hash: %s not found\n", job->cmd[i]);
     }
     return true;
 }
 
 /**
- * Adds a job to the list of jobs.
- * @param jobs array of jobs.
- * @param job job to add to the array.
+ * Wait command, wait [pid|%job]... waits for the given jobs, or for every child with no arguments.
+ * @param jobs table of jobs.
+ * @param job job with the arguments.
+ * @return true if success, false if fail.
  */
-void add_job(struct job_t *jobs, struct job_t job) {
-    int i;
-    register int j;
-    size_t size = 0;
-    for (i = 0; i < MAX_JOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i] = job;
-            break;
+bool wait_jobs(struct job_table *jobs, struct job_t *job) {
+    struct pollfd fds = {jobs->signal_fd, POLLIN, 0};
+    siginfo_t info;
+    pid_t pid;
+    char *end;
+    register int i, j;
+    if (job->cmd[1] == NULL) {
+        for (;;) {
+            reap_children(jobs, NULL, 0);
+            if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0 && errno == ECHILD)
+                return true;
+            poll(&fds, 1, -1);
+        }
+    }
+    for (i = 1; job->cmd[i] != NULL; i++) {
+        if (job->cmd[i][0] == '%') {
+            pid = strtol(job->cmd[i] + 1, &end, 10);
+            for (j = jobs->head; j != NO_JOB && jobs->jobs[j].jid != pid; j = jobs->jobs[j].next);
+            if (j == NO_JOB && *end == '\0' && pid > 0 && pid < jobs->next_jid)
+                continue; /* The job already ended and was reaped. */
+            pid = j != NO_JOB ? jobs->jobs[j].pid : 0;
+        } else {
+            pid = strtol(job->cmd[i], &end, 10);
+        }
+        /* Only a child that wasn't reaped yet can be waited for. */
+        if (*end != '\0' || pid <= 0 || waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) < 0) {
+            fprintf(stderr, "wait: %s is not a job of this shell\n", job->cmd[i]);
+            continue;
         }
+        wait_job(jobs, &pid, 1);
     }
+    return true;
 }
 
 /**
- * Removes job from the list.
- * @param jobs array of jobs.
- * @param job job to remove.
+ * Sets up an empty table of jobs, and blocks SIGCHLD so it is read from a signalfd instead.
+ * @param jobs table to set up.
  */
-void remove_job(struct job_t *jobs, struct job_t job) {
+void init_jobs(struct job_table *jobs) {
     register int i;
-    for (i = 0; i < MAX_JOBS; i++) {
-        if (jobs[i].pid == job.pid) {
-            memset(&jobs[i], '\0', sizeof(struct job_t));
-            break;
-        }
+    sigset_t mask;
+    for (i = 0; i < MAX_JOBS; i++)
+        jobs->jobs[i].next = i + 1 < MAX_JOBS ? i + 1 : NO_JOB;
+    for (i = 0; i < HASH_SIZE; i++)
+        jobs->buckets[i] = NO_JOB;
+    jobs->free = 0;
+    jobs->head = jobs->tail = NO_JOB;
+    jobs->next_jid = 1;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    jobs->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (jobs->signal_fd < 0) {
+        perror("signalfd");
+        exit(1);
+    }
+}
+
+/**
+ * Adds a job to the table, which takes its arena until the job is removed. A background job is
+ * numbered here, so only jobs the table holds take IDs.
+ * @param jobs table of jobs.
+ * @param job job to add to the table.
+ * @return true if added, false if the table is full.
+ */
+bool add_job(struct job_table *jobs, struct job_t *job) {
+    int i = jobs->free, bucket = job->pid & (HASH_SIZE - 1);
+    if (i == NO_JOB)
+        return false;
+    jobs->free = jobs->jobs[i].next;
+    if (job->state == background)
+        job->jid = jobs->next_jid++;
+    jobs->jobs[i] = *job;
+    job->arena.blocks = NULL;
+    jobs->jobs[i].next = NO_JOB;
+    jobs->jobs[i].prev = jobs->tail;
+    jobs->jobs[i].hash_next = jobs->buckets[bucket];
+    jobs->buckets[bucket] = i;
+    if (jobs->tail != NO_JOB)
+        jobs->jobs[jobs->tail].next = i;
+    else
+        jobs->head = i;
+    jobs->tail = i;
+    return true;
+}
+
+/**
+ * Removes a job from the table.
+ * @param jobs table of jobs.
+ * @param pid pid of the job to remove.
+ */
+void remove_job(struct job_table *jobs, pid_t pid) {
+    int *link = &jobs->buckets[pid & (HASH_SIZE - 1)], i;
+    struct job_t *job;
+    while (*link != NO_JOB && jobs->jobs[*link].pid != pid)
+        link = &jobs->jobs[*link].hash_next;
+    if ((i = *link) == NO_JOB)
+        return;
+    job = &jobs->jobs[i];
+    *link = job->hash_next;
+    if (job->prev != NO_JOB)
+        jobs->jobs[job->prev].next = job->next;
+    else
+        jobs->head = job->next;
+    if (job->next != NO_JOB)
+        jobs->jobs[job->next].prev = job->prev;
+    else
+        jobs->tail = job->prev;
+    job->pid = 0;
+    arena_free(&job->arena);
+    job->next = jobs->free;
+    jobs->free = i;
+}
+
+/**
+ * Reaps every child that exited and removes its job.
+ * @param jobs table of jobs.
+ * @param wanted pids to look for, each set to 0 once reaped.
+ * @param num number of wanted pids.
+ * @return number of wanted pids reaped.
+ */
+size_t reap_children(struct job_table *jobs, pid_t *wanted, size_t num) {
+    struct signalfd_siginfo info;
+    size_t found = 0, i;
+    pid_t pid;
+    while (read(jobs->signal_fd, &info, sizeof(info)) == sizeof(info)); /* Signals are merged, so only drained. */
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        remove_job(jobs, pid);
+        for (i = 0; i < num; i++)
+            if (wanted[i] == pid) {
+                wanted[i] = 0;
+                found++;
+            }
     }
+    return found;
+}
+
+/**
+ * Waits for every stage of a foreground job, reaping background jobs that exit meanwhile.
+ * @param jobs table of jobs.
+ * @param pids pids of the stages, 0 for stages that didn't start.
+ * @param num number of stages.
+ */
+void wait_job(struct job_table *jobs, pid_t *pids, size_t num) {
+    struct pollfd fds = {jobs->signal_fd, POLLIN, 0};
+    size_t left = 0, i;
+    for (i = 0; i < num; i++)
+        left += pids[i] != 0;
+    while ((left -= reap_children(jobs, pids, num)) > 0)
+        poll(&fds, 1, -1);
 }
 
 /**
  * Kills all jobs
- * @param jobs array of jobs to kill.
+ * @param jobs table of jobs to kill.
  */
-void kill_all(struct job_t *jobs) {
+void kill_all(struct job_table *jobs) {
     register int i;
-    for (i = 0; i < MAX_JOBS; i++) {
-        kill(jobs[i].pid, 0);
+    for (i = jobs->head; i != NO_JOB; i = jobs->jobs[i].next) {
+        kill(jobs->jobs[i].pid, 0);
     }
 }
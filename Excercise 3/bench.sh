@@ -0,0 +1,38 @@
+#!/bin/bash
+# Benchmarks ex32 end to end on a synthetic corpus: bench.sh [STUDENTS] [NUMBERS] [TIMEOUT]
+# Builds ex32, generates a corpus with gen_corpus.sh and grades it three times: cold (no compile
+# cache, no state), warm (compile cache, no state) and unchanged (cache and state). Prints the
+# time of every phase of every run, as reported by ex32 -T, and the total wall time.
+STUDENTS="${1:-200}"
+NUMBERS="${2:-1000}"
+TIMEOUT="${3:-1}"
+SRC=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d /tmp/bench.XXXXXX) || exit 1
+trap 'rm -rf "$WORK"' EXIT
+
+gcc -O2 -DCOMP_LIBRARY -pthread -o "$WORK/ex32" "$SRC/ex32.c" "$SRC/ex31.c" || exit 1
+CONF=$("$SRC/gen_corpus.sh" "$WORK/corpus" "$STUDENTS" "$NUMBERS") || exit 1
+
+# Grades the corpus once and prints "phase ms" lines, named after the run.
+grade() {
+	local START END
+	START=$(date +%s%N)
+	(cd "$WORK" && ./ex32 -T -t "$TIMEOUT" -c cache -s state -o results.csv "$CONF" 2> timings > /dev/null)
+	END=$(date +%s%N)
+	awk -v run="$1" '$3 == "ms" { print run, $1, $2 }' "$WORK/timings"
+	echo "$1" total $(((END - START) / 1000000))
+}
+
+{
+	grade cold
+	rm -f "$WORK/state"
+	grade warm
+	grade unchanged
+} | awk '
+	{ ms[$1, $2] = $3; if (!($2 in seen)) { seen[$2] = 1; phases[n++] = $2 } }
+	END {
+		printf "%-10s %10s %10s %10s\n", "phase (ms)", "cold", "warm", "unchanged"
+		for (i = 0; i < n; i++)
+			printf "%-10s %10s %10s %10s\n", phases[i], ms["cold", phases[i]], ms["warm", phases[i]], ms["unchanged", phases[i]]
+	}'
+cut -d, -f3 "$WORK/results.csv" | sort | uniq -c
@@ -0,0 +1,128 @@
+#ifndef __COMP__
+#define __COMP__
+
+#include <sys/types.h>
+
+/**
+ * Result of a comparison, also the exit code of comp.out.
+ */
+typedef enum diff { INVALID, DIFFERENT, SIMILAR, IDENTICAL } diff;
+
+/**
+ * Expected output, loaded and compacted once so it can be compared against many candidates.
+ */
+typedef struct comp_reference comp_reference;
+
+/**
+ * A candidate compared while it is produced, see comp_stream_open.
+ */
+typedef struct comp_stream comp_stream;
+
+/**
+ * Sets the number of threads used for a single comparison (default 1).
+ * @param threads Number of threads, 0 or less for every core.
+ */
+void comp_set_threads(int threads);
+
+/**
+ * Sets the normalization rules used to decide SIMILAR, before loading references.
+ * @param rules Comma separated list of:
+ *              spaces  - ignore white space
+ *              case    - ignore case
+ *              eol     - ignore new lines at the end
+ *              runs    - treat a run of white space as one space (spaces wins over it)
+ *              num=EPS - numbers are equal within EPS (use with runs so numbers stay apart)
+ *              The default is "spaces,case".
+ * @return 0, -1 if a rule is unknown.
+ */
+int comp_set_spec(const char *rules);
+
+/**
+ * Keeps 128-bit fingerprints of the candidates compared by path (and of their normalized form) in
+ * a sidecar file, keyed by path, size and mtime. A candidate that didn't change is judged from its
+ * fingerprint without being read: IDENTICAL or SIMILAR if it matches the reference's, compared in
+ * full otherwise.
+ * @param path Sidecar file, read if it exists. NULL writes the sidecar back and stops using it.
+ * @return 0, -1 if the sidecar can't be written.
+ */
+int comp_set_cache(const char *path);
+
+/**
+ * Sets whether fingerprint matches are confirmed by a full comparison (default 0).
+ * @param full 1 to always compare the contents.
+ */
+void comp_set_verify(int full);
+
+/**
+ * Loads and compacts the expected output.
+ * @param path Path of the expected output.
+ * @return The reference, NULL if the file can't be read.
+ */
+comp_reference *comp_load_reference(const char *path);
+
+/**
+ * Frees a reference.
+ * @param ref Reference to free.
+ */
+void comp_free_reference(comp_reference *ref);
+
+/**
+ * Compares a candidate read from a file descriptor until EOF. The descriptor is not closed.
+ * @param ref   Expected output.
+ * @param fd    Descriptor of the candidate.
+ * @return IDENTICAL, SIMILAR or DIFFERENT, INVALID if the candidate can't be read.
+ */
+diff comp_compare_fd(const comp_reference *ref, int fd);
+
+/**
+ * Compares a candidate file.
+ * @param ref   Expected output.
+ * @param path  Path of the candidate.
+ * @return IDENTICAL, SIMILAR or DIFFERENT, INVALID if the candidate can't be read.
+ */
+diff comp_compare_file(const comp_reference *ref, const char *path);
+
+/**
+ * Scores how close a candidate file is to the expected output, for partial credit.
+ * @param ref   Expected output.
+ * @param path  Path of the candidate.
+ * @param floor Scores below this are reported as 0, higher floors are faster.
+ * @return 1 minus the edit distance of the compacted files over the longer length (per line for
+ *         long files), -1 if the candidate can't be read.
+ */
+double comp_score_file(const comp_reference *ref, const char *path, double floor);
+
+/**
+ * Compares a list of candidate files.
+ * @param ref       Expected output.
+ * @param paths     Paths of the candidates.
+ * @param num       Number of candidates.
+ * @param results   Filled with the result of every candidate.
+ */
+void comp_compare_batch(const comp_reference *ref, char *const *paths, int num, diff *results);
+
+/**
+ * Starts comparing a candidate that arrives in pieces, for output read from a pipe. Only what is
+ * needed to decide is kept, not the whole candidate (unless a numeric tolerance is set).
+ * @param ref   Expected output, kept until the stream is closed.
+ * @return The stream.
+ */
+comp_stream *comp_stream_open(const comp_reference *ref);
+
+/**
+ * Compares the next piece of the candidate.
+ * @param stream  Stream to feed.
+ * @param data    Next bytes of the candidate.
+ * @param len     Number of bytes.
+ * @return 1 once the candidate is DIFFERENT whatever follows, 0 otherwise.
+ */
+int comp_stream_feed(comp_stream *stream, const char *data, size_t len);
+
+/**
+ * Ends the candidate and frees the stream.
+ * @param stream  Stream to close.
+ * @return IDENTICAL, SIMILAR or DIFFERENT.
+ */
+diff comp_stream_close(comp_stream *stream);
+
+#endif
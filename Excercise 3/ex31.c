@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,51 +7,358 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include "comp.h"
 
-#define MAX(a, b) a>(b)?(a):b
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+#define ERROR_RESULT -1
 #define BUFFER_SIZE 128
+#define BENCH_SECONDS 0.25
+#define CALIBRATION_SIZE (1 << 14)
+#define CALIBRATION_ROUNDS 5
+#define CHUNK_SIZE (1 << 20)
+#define CANCEL_STEP (1 << 16)
+#define CONTEXT_SIZE 16
+#define SCORE_FLOOR 0.5
+#define CHAR_SCORE_LIMIT (1 << 16)
+#define DENSE_PEQ_WORDS (1 << 20)
+#define SCORE_WORK_LIMIT (1ULL << 28)
+#define WORD_BITS 64
+#define HIGH_BIT (1ULL << 63)
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define NUMBER_SIZE 64
+#define NUMBER_CHARS "0123456789.+-eE"
+#define ENTRY_DROP (1 << 8)
+#define ENTRY_SPACE (1 << 9)
+#define FP_BLOCK_SIZE (1 << 16)
+#define FP_PRIME_1 0x9E3779B97F4A7C15ULL
+#define FP_PRIME_2 0xC2B2AE3D27D4EB4FULL
+#define SIDECAR_FORMAT "%016llx %016llx %016llx %016llx %016llx %lld %lld %s\n"
+#define SIDECAR_SCAN "%llx %llx %llx %llx %llx %lld %lld %n"
 #define ALLOCATION_FAILURE "Allocation failure.\n"
 #define SYS_CALL_ERROR "Error in system call"
 
 const char spaces[] = {' ', '\t', '\n', '\r', '\f'};
 
 typedef enum bool { false, true } bool;
-typedef enum diff { INVALID, DIFFERENT, SIMILAR, IDENTICAL } diff;
+
+/**
+ * Normalization rules of similar(). They are compiled to norm_table, one entry per byte: the byte
+ * to output in the low 8 bits, ENTRY_DROP to skip it, ENTRY_SPACE if it starts or continues a run
+ * of spaces. tolerance is negative when numbers are compared as text.
+ */
+typedef struct norm_spec {
+  bool ignore_spaces;
+  bool fold_case;
+  bool trailing_newlines;
+  bool collapse_spaces;
+  double tolerance;
+} norm_spec;
+
+/**
+ * Comparison kernels. mismatch returns the index of the first differing byte (or len if none),
+ * compact copies src to dst without spaces and in lower case and returns the new length,
+ * count returns the number of new lines in a buffer.
+ */
+typedef size_t (*mismatch_kernel)(const char *, const char *, size_t);
+typedef size_t (*compact_kernel)(char *, const char *, size_t);
+typedef size_t (*count_kernel)(const char *, size_t);
+typedef struct kernel_set {
+  const char *name;
+  mismatch_kernel mismatch;
+  compact_kernel compact;
+  count_kernel count;
+} kernel_set;
+
+/**
+ * A compacted file. The file is compacted in CHUNK_SIZE chunks, so chunk c of the result starts
+ * at data + c * CHUNK_SIZE, and prefix[c] is the offset of that chunk in the compacted stream.
+ * When diagnosing, lines[c] is the number of new lines in chunk c of the source.
+ */
+typedef struct norm_t {
+  const char *src;
+  size_t src_len;
+  char *data;
+  size_t num_chunks;
+  size_t *prefix;
+  size_t *lines;
+} norm_t;
+
+/**
+ * Where the files first differ, in each of the files (offsets start at 0, lines and columns at 1).
+ */
+typedef struct position {
+  size_t offset;
+  size_t line;
+  size_t column;
+} position;
+typedef struct diagnostics {
+  bool exact_found;
+  position exact;
+  bool norm_found;
+  position norm[2];
+  double score;
+} diagnostics;
+
+typedef unsigned long long word;
+
+/**
+ * Work shared by the comparison threads. Tasks are taken in order from next, and found holds the
+ * lowest mismatch seen so far, so tasks after it are cancelled.
+ */
+typedef void (*task_fn)(void *, size_t);
+typedef struct pool_t {
+  task_fn task;
+  void *ctx;
+  size_t num_tasks;
+  size_t next;
+} pool_t;
+typedef struct compare_ctx {
+  const char *a, *b;
+  const norm_t *norm_a, *norm_b;
+  size_t len;
+  size_t found;
+  size_t *lines;
+} compare_ctx;
+
+/**
+ * 128-bit hashes of a file, of its bytes and of its compacted form, to judge files that were seen
+ * before without reading them.
+ */
+typedef struct fingerprint {
+  word exact[2];
+  word norm[2];
+} fingerprint;
+
+/**
+ * A 128-bit hash being computed, 8 bytes at a time in two lanes. tail holds the bytes of a word
+ * that isn't complete yet.
+ */
+typedef struct hash128 {
+  word h[2];
+  word len;
+  unsigned char tail[8];
+  size_t tail_len;
+} hash128;
+
+/**
+ * Fingerprint of a file in the sidecar, valid while the file keeps its size and mtime and the spec
+ * hashes to spec_key.
+ */
+typedef struct sidecar_entry {
+  char *path;
+  word spec_key;
+  long long size;
+  long long mtime_ns;
+  fingerprint fp;
+} sidecar_entry;
+
+/**
+ * Sidecar cache of fingerprints, loaded from path and written back to it. slots is an open
+ * addressing table of entry numbers (index + 1, 0 for a free slot) keyed by path.
+ */
+typedef struct sidecar_t {
+  char *path;
+  sidecar_entry *entries;
+  size_t num;
+  size_t capacity;
+  size_t *slots;
+  size_t num_slots;
+  bool dirty;
+} sidecar_t;
+
+struct comp_reference {
+  char *data;
+  ssize_t len;
+  norm_t norm;
+  fingerprint fp;
+};
+
+/**
+ * A candidate compared while it is read. exact is true while the candidate is a prefix of the
+ * reference, norm while its compacted form is a prefix of the compacted reference. With the eol
+ * rule, compacted bytes that may turn out to be trailing new lines are held in buffer (pending)
+ * until something else follows. With a numeric tolerance everything is kept in buffer instead,
+ * and compared when the stream is closed.
+ */
+struct comp_stream {
+  const comp_reference *ref;
+  size_t pos;
+  bool exact;
+  size_t norm_pos;
+  bool norm;
+  bool after_space;
+  char *buffer;
+  size_t capacity;
+  size_t pending;
+};
 
 bool identical(const char *, const char *, ssize_t);
-bool similar(const char *, const char *, ssize_t);
+bool similar(const norm_t *, const norm_t *, size_t *);
+diff compare_buffers(const char *, ssize_t, const norm_t *, const char *, ssize_t, diagnostics *);
 bool is_space(char);
-ssize_t file_to_buffer(char *, char **);
+void compile_spec();
+size_t compact(char *, const char *, size_t, bool);
+size_t compact_table(char *, const char *, size_t, bool);
+ssize_t fd_to_buffer(int, char **);
+ssize_t file_to_buffer(const char *, char **);
 void check_sys_call(ssize_t);
 void check_allocation(void *);
+size_t mismatch_scalar(const char *, const char *, size_t);
+size_t compact_scalar(char *, const char *, size_t);
+size_t count_scalar(const char *, size_t);
+int supported_kernels(const kernel_set **);
+void init_kernels();
+static double time_compact(compact_kernel, const char *, char *);
+static double now();
+void benchmark(const char *, ssize_t);
+void run_tasks(task_fn, void *, size_t);
+size_t first_mismatch(const char *, const char *, size_t, size_t *);
+void normalize(norm_t *, norm_t *);
+size_t first_norm_mismatch(const norm_t *, const norm_t *);
+bool similar_numbers(const norm_t *, const norm_t *, size_t *);
+static size_t buffer_mismatch(const norm_t *, size_t, const char *, size_t);
+void free_norm(norm_t *);
+double score_buffers(const char *, ssize_t, const char *, ssize_t, double);
+size_t edit_distance(const unsigned *, size_t, const unsigned *, size_t, unsigned, size_t);
+position norm_position(const norm_t *, size_t);
+void init_once();
+int batch(const char *, char **);
+void print_diagnostics(diff, const diagnostics *, const char *, ssize_t, const char *, ssize_t, bool);
+void fingerprint_buffer(const char *, size_t, fingerprint *);
+ssize_t fingerprint_file(const char *, fingerprint *, char **);
+static diff fingerprint_verdict(const fingerprint *, const fingerprint *);
+
+const kernel_set *kernels = NULL;
+kernel_set tuned_kernels;
+bool vector_compact = false;
+int num_threads = 1;
+bool diagnose = false;
+norm_spec spec = {true, true, false, false, -1};
+unsigned short norm_table[256];
+bool space_table[256];
+pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+sidecar_t sidecar;
+pthread_mutex_t sidecar_lock = PTHREAD_MUTEX_INITIALIZER;
+bool verify = false;
 
+#ifndef COMP_LIBRARY
+/**
+ * comp.out file1 file2 compares two files, the exit code is the result.
+ * With -d it also prints where the files first differ, exactly and after compaction, and with -m
+ * it prints the result and the differences as a single JSON line instead.
+ * With -s it also prints a similarity score between 0 and 1, from the edit distance of the
+ * compacted files (per line for long files), 0 when below SCORE_FLOOR.
+ * -n rules sets the normalization used for SIMILAR, see comp_set_spec (default "spaces,case").
+ * comp.out -r reference [candidate...] compares many candidates (read from stdin when none are
+ * given, one path per line) against one reference and prints a result per candidate.
+ * -c sidecar keeps fingerprints of the files in a sidecar, so unchanged files that hash the same
+ * as the reference are IDENTICAL or SIMILAR without being read, -v verifies those by comparing.
+ */
 int main(int argc, char *argv[]) {
-  if (!argv[1] || !argv[2]) { // Check if no argument is given.
+  bool bench = false, machine = false, score_mode = false;
+  char *reference = NULL, *cache = NULL;
+  fingerprint fp1, fp2;
+  diagnostics diag;
+  double score = -1;
+  int opt;
+  while ((opt = getopt(argc, argv, "bc:dj:mn:r:sv")) != -1) {
+    switch (opt) {
+    case 'n':
+      if (comp_set_spec(optarg) == ERROR_RESULT)
+        return INVALID;
+      break;
+    case 'b': bench = true;
+      break;
+    case 's': score_mode = true;
+      break;
+    case 'm': machine = true;
+      diagnose = true;
+      break;
+    case 'd': diagnose = true;
+      break;
+    case 'j': comp_set_threads(atoi(optarg));
+      break;
+    case 'r': reference = optarg;
+      break;
+    case 'c': cache = optarg;
+      break;
+    case 'v': comp_set_verify(1);
+      break;
+    default: return INVALID;
+    }
+  }
+  argv += optind - 1;
+  if (cache && comp_set_cache(cache) == ERROR_RESULT)
+    return INVALID;
+  if (reference) {
+    opt = batch(reference, argv + 1);
+    if (cache)
+      check_sys_call(comp_set_cache(NULL));
+    return opt;
+  }
+  if (!argv[1] || (!bench && !argv[2])) { // Check if no argument is given.
     return INVALID;
   }
-  ssize_t file1_len = 0, file2_len = 0, max_len = 0;
+  ssize_t file1_len = 0, file2_len = 0;
   diff difference = INVALID;
   char *file1_buffer = NULL;
   char *file2_buffer = NULL;
 
-  // Load files to heap.
-  file1_len = file_to_buffer(argv[1], &file1_buffer);
-  file2_len = file_to_buffer(argv[2], &file2_buffer);
+  init_kernels();
 
-  max_len = MAX(file1_len, file2_len);
+  // Fingerprints decide alone unless the differences are needed.
+  if (cache && !bench && !diagnose && !score_mode) {
+    file1_len = fingerprint_file(argv[1], &fp1, &file1_buffer);
+    check_sys_call(file1_len);
+    file2_len = fingerprint_file(argv[2], &fp2, &file2_buffer);
+    check_sys_call(file2_len);
+    check_sys_call(comp_set_cache(NULL));
+    difference = verify ? DIFFERENT : fingerprint_verdict(&fp1, &fp2);
+  }
 
-  // First check for the files lengths. If length is the same, check if identical.
-  if (file1_len == file2_len && identical(file1_buffer, file2_buffer, max_len)) {
-    difference = IDENTICAL;
-    printf("IDENTICAL\n");
-  } else if (similar(file1_buffer, file2_buffer, max_len)) { // If files are not identical, check if similar.
-    printf("SIMILAR\n");
-    difference = SIMILAR;
-  } else { // If files are not identical and not similar, they are different.
-    printf("DIFFERENT\n");
-    difference = DIFFERENT;
+  if (difference == INVALID || difference == DIFFERENT) {
+    // Load files to heap.
+    if (!file1_buffer)
+      file1_len = file_to_buffer(argv[1], &file1_buffer);
+    check_sys_call(file1_len);
+    if (bench) {
+      benchmark(file1_buffer, file1_len);
+      free(file1_buffer);
+      return INVALID;
+    }
+    if (!file2_buffer)
+      file2_len = file_to_buffer(argv[2], &file2_buffer);
+    check_sys_call(file2_len);
+    difference = compare_buffers(file1_buffer, file1_len, NULL, file2_buffer, file2_len, diagnose ? &diag : NULL);
+  }
+  if (score_mode)
+    score = difference == DIFFERENT ? score_buffers(file1_buffer, file1_len, file2_buffer, file2_len, SCORE_FLOOR) : 1;
+  if (machine) {
+    diag.score = score;
+    print_diagnostics(difference, &diag, file1_buffer, file1_len, file2_buffer, file2_len, true);
+  } else {
+    switch (difference) {
+    case IDENTICAL: printf("IDENTICAL\n");
+      break;
+    case SIMILAR: printf("SIMILAR\n");
+      break;
+    default: printf("DIFFERENT\n");
+      break;
+    }
+    if (diagnose)
+      print_diagnostics(difference, &diag, file1_buffer, file1_len, file2_buffer, file2_len, false);
+    if (score_mode)
+      printf("SCORE: %.4f\n", score);
+    printf("RESULT IS: %d\n", difference);
   }
-  printf("RESULT IS: %d\n", difference);
 
   free(file1_buffer);
   free(file2_buffer);
@@ -59,42 +367,179 @@ int main(int argc, char *argv[]) {
 }
 
 /**
- * Loads the file to a buffer on the heap. Saves read from memory.
- * It's messy because needed to change file operations to system calls.
- * @param path Path of the file.
- * @param file_buffer Buffer to load into.
- * @return Length of the file.
+ * Batch mode: loads and compacts the reference once and prints "RESULT path" per candidate.
+ * @param reference Path of the expected output.
+ * @param paths NULL terminated list of candidates, read from stdin if empty.
+ * @return 0, the results are printed.
+ */
+int batch(const char *reference, char **paths) {
+  const char *names[] = {"INVALID", "DIFFERENT", "SIMILAR", "IDENTICAL"};
+  comp_reference *ref = comp_load_reference(reference);
+  char *line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  if (!ref)
+    check_sys_call(ERROR_RESULT);
+  if (*paths) {
+    for (; *paths; paths++)
+      printf("%s %s\n", names[comp_compare_file(ref, *paths)], *paths);
+  } else {
+    while ((len = getline(&line, &line_size, stdin)) > 0) {
+      if (line[len - 1] == '\n')
+        line[len - 1] = '\0';
+      if (*line)
+        printf("%s %s\n", names[comp_compare_file(ref, line)], line);
+    }
+    free(line);
+  }
+  comp_free_reference(ref);
+  return 0;
+}
+
+/**
+ * Prints a piece of a buffer as a quoted JSON string.
+ * @param buffer Buffer to print from.
+ * @param from First byte to print.
+ * @param to End of the piece, not printed.
+ */
+static void print_escaped(const char *buffer, size_t from, size_t to) {
+  register size_t i;
+  putchar('"');
+  for (i = from; i < to; i++) {
+    unsigned char c = (unsigned char) buffer[i];
+    switch (c) {
+    case '"': printf("\\\"");
+      break;
+    case '\\': printf("\\\\");
+      break;
+    case '\n': printf("\\n");
+      break;
+    case '\t': printf("\\t");
+      break;
+    case '\r': printf("\\r");
+      break;
+    default:
+      if (c < ' ' || c >= 0x7F)
+        printf("\\u%04x", c);
+      else
+        putchar(c);
+    }
+  }
+  putchar('"');
+}
+
+/**
+ * Prints a position and the text around it, as a line or as a JSON object.
+ * @param name Name of the file.
+ * @param pos Position to print.
+ * @param buffer Content of the file.
+ * @param len Length of the file.
+ * @param machine Print JSON.
+ */
+static void print_position(const char *name, position pos, const char *buffer, ssize_t len, bool machine) {
+  size_t from = pos.offset > CONTEXT_SIZE ? pos.offset - CONTEXT_SIZE : 0;
+  size_t to = pos.offset + CONTEXT_SIZE < (size_t) len ? pos.offset + CONTEXT_SIZE : (size_t) len;
+  if (machine)
+    printf("\"%s\":{\"offset\":%zu,\"line\":%zu,\"column\":%zu,\"before\":", name, pos.offset, pos.line, pos.column);
+  else
+    printf("  %s: byte %zu, line %zu, column %zu, near ", name, pos.offset, pos.line, pos.column);
+  print_escaped(buffer, from, pos.offset);
+  printf(machine ? ",\"after\":" : " >> ");
+  print_escaped(buffer, pos.offset, to);
+  printf(machine ? "}" : "\n");
+}
+
+/**
+ * Prints where the files first differ, as lines or as one JSON line with the result.
+ * @param difference Result of the comparison.
+ * @param diag Differences found by the comparison.
+ * @param file1 Content of the first file.
+ * @param file1_len Length of the first file.
+ * @param file2 Content of the second file.
+ * @param file2_len Length of the second file.
+ * @param machine Print JSON.
+ */
+void print_diagnostics(diff difference, const diagnostics *diag, const char *file1, ssize_t file1_len,
+                       const char *file2, ssize_t file2_len, bool machine) {
+  const char *names[] = {"INVALID", "DIFFERENT", "SIMILAR", "IDENTICAL"};
+  if (machine)
+    printf("{\"result\":\"%s\",\"code\":%d,\"exact\":", names[difference], difference);
+  if (diag->exact_found) {
+    printf(machine ? "{" : "exact difference:\n");
+    print_position("file1", diag->exact, file1, file1_len, machine);
+    printf(machine ? "," : "");
+    print_position("file2", diag->exact, file2, file2_len, machine);
+    printf(machine ? "}" : "");
+  } else if (machine) {
+    printf("null");
+  }
+  printf(machine ? ",\"normalized\":" : "");
+  if (diag->norm_found) {
+    printf(machine ? "{" : "normalized difference:\n");
+    print_position("file1", diag->norm[0], file1, file1_len, machine);
+    printf(machine ? "," : "");
+    print_position("file2", diag->norm[1], file2, file2_len, machine);
+    printf(machine ? "}" : "");
+  } else if (machine) {
+    printf("null");
+  }
+  if (machine && diag->score >= 0)
+    printf(",\"score\":%.4f", diag->score);
+  printf(machine ? "}\n" : "");
+}
+#endif
+
+/**
+ * Loads everything left in a descriptor to a buffer on the heap.
+ * The buffer is sized from fstat up front and grows geometrically for files that keep growing,
+ * and is always NUL terminated (the terminator is not counted in the length).
+ * @param file_descriptor Descriptor to read.
+ * @param file_buffer Buffer to load into, NULL on failure.
+ * @return Length of the file, -1 on failure.
  */
-ssize_t file_to_buffer(char *path, char **file_buffer) {
-  char temp_buffer[BUFFER_SIZE];
-  memset(temp_buffer, '\0', BUFFER_SIZE * sizeof(char));
-  int file_descriptor;
+ssize_t fd_to_buffer(int file_descriptor, char **file_buffer) {
+  struct stat info;
   register ssize_t file_len = 0;
   register ssize_t num_bytes_read;
-  register ssize_t to_alloc = BUFFER_SIZE;
-  file_descriptor = open(path, O_RDONLY);
-  check_sys_call(file_descriptor);
-  num_bytes_read = read(file_descriptor, temp_buffer, BUFFER_SIZE * sizeof(char));
-  file_len = num_bytes_read;
-  to_alloc += file_len;
-  *file_buffer = (char *) calloc((num_bytes_read), sizeof(char));
+  size_t to_alloc = BUFFER_SIZE;
+  if (fstat(file_descriptor, &info) == 0 && S_ISREG(info.st_mode))
+    to_alloc += (size_t) info.st_size;
+  *file_buffer = (char *) malloc(to_alloc);
   check_allocation(*file_buffer);
-  strcpy(*file_buffer, temp_buffer);
 
-  num_bytes_read = read(file_descriptor, temp_buffer, (BUFFER_SIZE) * sizeof(char));
-  while (num_bytes_read) {
-    to_alloc += num_bytes_read;
+  do {
+    if ((size_t) file_len + 1 == to_alloc) {
+      to_alloc *= 2;
+      *file_buffer = (char *) realloc(*file_buffer, to_alloc);
+      check_allocation(*file_buffer);
+    }
+    num_bytes_read = read(file_descriptor, *file_buffer + file_len, to_alloc - file_len - 1);
+    if (num_bytes_read < 0) {
+      free(*file_buffer);
+      *file_buffer = NULL;
+      return ERROR_RESULT;
+    }
     file_len += num_bytes_read;
-    check_sys_call(num_bytes_read);
-    *file_buffer = (char *) realloc(*file_buffer, (to_alloc) * sizeof(char));
-    check_allocation(*file_buffer);
-    strcat(*file_buffer, temp_buffer);
-    num_bytes_read = read(file_descriptor, temp_buffer, BUFFER_SIZE * sizeof(char));
-  }
+  } while (num_bytes_read);
+  (*file_buffer)[file_len] = '\0';
 
-  num_bytes_read = close(file_descriptor);
-  check_sys_call(num_bytes_read);
+  return file_len;
+}
 
+/**
+ * Loads the file to a buffer on the heap. Saves read from memory.
+ * @param path Path of the file.
+ * @param file_buffer Buffer to load into, NULL on failure.
+ * @return Length of the file, -1 on failure.
+ */
+ssize_t file_to_buffer(const char *path, char **file_buffer) {
+  ssize_t file_len;
+  int file_descriptor = open(path, O_RDONLY);
+  *file_buffer = NULL;
+  if (file_descriptor < 0)
+    return ERROR_RESULT;
+  file_len = fd_to_buffer(file_descriptor, file_buffer);
+  close(file_descriptor);
   return file_len;
 }
 
@@ -129,57 +574,588 @@ inline void check_sys_call(ssize_t fd) {
  * @return True if files are identical, false otherwise.
  */
 bool identical(const char *file1, const char *file2, ssize_t max_len) {
-  register int i = 0;
-  for (i = 0; i < max_len; i++) {
-    if (file1[i] != file2[i]) {
-      return false;
-    }
-  }
-  return true;
+  return first_mismatch(file1, file2, (size_t) max_len, NULL) == (size_t) max_len ? true : false;
 }
 
 /**
- * Checks if two buffers (containing the content of the files) are similar.
- * @param file1 First buffer to compare
- * @param file2 Second buffer to compare
- * @param max_len Length of the larger buffer
+ * Checks if two compacted files (normalized by spec) are the same.
+ * @param norm1 First compacted file
+ * @param norm2 Second compacted file
+ * @param pos If not NULL, set to where the compacted files first differ, in each of them.
  * @return True if files are similar, false otherwise.
  */
-bool similar(const char *file1, const char *file2, ssize_t max_len) {
-  char a[max_len], b[max_len];
-  memset(a, '\0', (size_t) max_len);
-  memset(b, '\0', (size_t) max_len);
+bool similar(const norm_t *norm1, const norm_t *norm2, size_t *pos) {
+  size_t len = norm1->prefix[norm1->num_chunks], at;
+  if (spec.tolerance >= 0)
+    return similar_numbers(norm1, norm2, pos);
+  if (!pos && len != norm2->prefix[norm2->num_chunks])
+    return false;
+  at = first_norm_mismatch(norm1, norm2);
+  if (pos)
+    pos[0] = pos[1] = at;
+  return len == norm2->prefix[norm2->num_chunks] && at == len ? true : false;
+}
+
+/**
+ * Column of an offset: distance from the last new line before it.
+ */
+static size_t column_of(const char *buffer, size_t offset) {
+  const char *line_start = memrchr(buffer, '\n', offset);
+  return line_start ? (size_t) (buffer + offset - line_start) : offset + 1;
+}
 
-  register int i = 0;
-  register int j = 0;
+/**
+ * Decides if two buffers are identical, similar or different.
+ * When diagnosing, the passes that decide the result also find where the files first differ.
+ * @param file1 First buffer.
+ * @param file1_len Length of the first buffer.
+ * @param norm1 First buffer already compacted, or NULL to compact it here if needed.
+ * @param file2 Second buffer.
+ * @param file2_len Length of the second buffer.
+ * @param diag Filled with where the files differ, or NULL.
+ * @return IDENTICAL, SIMILAR or DIFFERENT.
+ */
+diff compare_buffers(const char *file1, ssize_t file1_len, const norm_t *norm1, const char *file2, ssize_t file2_len,
+                     diagnostics *diag) {
+  norm_t own = {.src = file1, .src_len = (size_t) file1_len}, other = {.src = file2, .src_len = (size_t) file2_len};
+  size_t common = (size_t) (file1_len < file2_len ? file1_len : file2_len), pos, norm_pos[2];
+  diff difference;
+  if (diag) {
+    memset(diag, 0, sizeof(diagnostics));
+    pos = first_mismatch(file1, file2, common, &diag->exact.line);
+    if (file1_len == file2_len && pos == common)
+      return IDENTICAL;
+    diag->exact_found = true;
+    diag->exact.offset = pos;
+    diag->exact.column = column_of(file1, pos);
+  } else if (file1_len == file2_len && identical(file1, file2, file1_len)) {
+    // First check for the files lengths. If length is the same, check if identical.
+    return IDENTICAL;
+  }
+  // If files are not identical, check if similar.
+  if (norm1) {
+    normalize(&other, NULL);
+  } else {
+    normalize(&own, &other);
+    norm1 = &own;
+  }
+  difference = similar(norm1, &other, diag ? norm_pos : NULL) ? SIMILAR : DIFFERENT;
+  if (diag && difference == DIFFERENT && norm1->lines) {
+    diag->norm_found = true;
+    diag->norm[0] = norm_position(norm1, norm_pos[0]);
+    diag->norm[1] = norm_position(&other, norm_pos[1]);
+  }
+  if (norm1 == &own)
+    free_norm(&own);
+  free_norm(&other);
+  return difference;
+}
 
-  // Copy file1 to a
-  for (i = 0, j = 0; i < max_len; i++) {
-    if (file1[i] == 0) {
-      break;
-    }
-    if (is_space(file1[i])) {
-      continue;
+/**
+ * Picks the kernels once, even when the library is used from several threads.
+ */
+void init_once() {
+  pthread_once(&kernels_once, init_kernels);
+}
+
+/**
+ * Builds the byte tables from spec.
+ */
+void compile_spec() {
+  register int c;
+  register size_t i;
+  for (c = 0; c < 256; c++)
+    space_table[c] = false;
+  for (i = 0; i < sizeof(spaces); i++)
+    space_table[(unsigned char) spaces[i]] = true;
+  for (c = 0; c < 256; c++) {
+    norm_table[c] = (unsigned char) (spec.fold_case ? tolower(c) : c);
+    if (space_table[c] && spec.ignore_spaces)
+      norm_table[c] = ENTRY_DROP;
+    else if (space_table[c] && spec.collapse_spaces)
+      norm_table[c] = ' ' | ENTRY_SPACE;
+  }
+}
+
+int comp_set_spec(const char *rules) {
+  norm_spec parsed = {false, false, false, false, -1};
+  char *copy = strdup(rules), *token, *save = NULL, *end;
+  check_allocation(copy);
+  for (token = strtok_r(copy, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+    if (!strcmp(token, "spaces")) {
+      parsed.ignore_spaces = true;
+    } else if (!strcmp(token, "case")) {
+      parsed.fold_case = true;
+    } else if (!strcmp(token, "eol")) {
+      parsed.trailing_newlines = true;
+    } else if (!strcmp(token, "runs")) {
+      parsed.collapse_spaces = true;
+    } else if (!strncmp(token, "num=", 4)) {
+      parsed.tolerance = strtod(token + 4, &end);
+      if (end == token + 4 || *end != '\0' || !(parsed.tolerance >= 0)) { /* NaN fails >= too */
+        free(copy);
+        return ERROR_RESULT;
+      }
+    } else {
+      free(copy);
+      return ERROR_RESULT;
     }
-    a[j++] = (char) tolower(file1[i]);
   }
-  // Copy file2 to b
-  for (i = 0, j = 0; i < max_len; i++) {
-    if (file2[i] == 0) {
-      break;
+  free(copy);
+  spec = parsed;
+  init_once();
+  compile_spec();
+  return 0;
+}
+
+void comp_set_threads(int threads) {
+  num_threads = threads > 0 ? threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+comp_reference *comp_load_reference(const char *path) {
+  comp_reference *ref = calloc(1, sizeof(comp_reference));
+  check_allocation(ref);
+  init_once();
+  ref->len = file_to_buffer(path, &ref->data);
+  if (ref->len < 0) {
+    free(ref);
+    return NULL;
+  }
+  ref->norm.src = (const char *) ref->data;
+  ref->norm.src_len = (size_t) ref->len;
+  normalize(&ref->norm, NULL);
+  fingerprint_buffer(ref->data, (size_t) ref->len, &ref->fp);
+  return ref;
+}
+
+void comp_free_reference(comp_reference *ref) {
+  if (!ref)
+    return;
+  free(ref->data);
+  free_norm(&ref->norm);
+  free(ref);
+}
+
+diff comp_compare_fd(const comp_reference *ref, int fd) {
+  char *buffer;
+  ssize_t len = fd_to_buffer(fd, &buffer);
+  diff difference;
+  if (len < 0)
+    return INVALID;
+  difference = compare_buffers(ref->data, ref->len, &ref->norm, buffer, len, NULL);
+  free(buffer);
+  return difference;
+}
+
+diff comp_compare_file(const comp_reference *ref, const char *path) {
+  char *buffer = NULL;
+  ssize_t len;
+  fingerprint fp;
+  diff difference;
+  if (sidecar.path) {
+    if ((len = fingerprint_file(path, &fp, &buffer)) < 0)
+      return INVALID;
+    difference = fingerprint_verdict(&ref->fp, &fp);
+    if (difference != DIFFERENT && !verify) {
+      free(buffer);
+      return difference;
     }
-    if (is_space(file2[i])) {
-      continue;
+  }
+  if (!buffer && (len = file_to_buffer(path, &buffer)) < 0)
+    return INVALID;
+  difference = compare_buffers(ref->data, ref->len, &ref->norm, buffer, len, NULL);
+  free(buffer);
+  return difference;
+}
+
+double comp_score_file(const comp_reference *ref, const char *path, double floor) {
+  char *buffer;
+  ssize_t len = file_to_buffer(path, &buffer);
+  double score;
+  if (len < 0)
+    return ERROR_RESULT;
+  score = score_buffers(ref->data, ref->len, buffer, len, floor);
+  free(buffer);
+  return score;
+}
+
+void comp_compare_batch(const comp_reference *ref, char *const *paths, int num, diff *results) {
+  register int i;
+  for (i = 0; i < num; i++)
+    results[i] = comp_compare_file(ref, paths[i]);
+}
+
+comp_stream *comp_stream_open(const comp_reference *ref) {
+  comp_stream *stream = calloc(1, sizeof(comp_stream));
+  check_allocation(stream);
+  stream->ref = ref;
+  stream->exact = true;
+  stream->norm = true;
+  return stream;
+}
+
+/**
+ * Makes room for len more bytes after the pending ones.
+ */
+static void reserve(comp_stream *stream, size_t len) {
+  if (stream->pending + len <= stream->capacity)
+    return;
+  stream->capacity = stream->pending + len > 2 * stream->capacity ? stream->pending + len : 2 * stream->capacity;
+  stream->buffer = realloc(stream->buffer, stream->capacity);
+  check_allocation(stream->buffer);
+}
+
+/**
+ * Checks if a compacted byte is cut from the end by the eol rule.
+ */
+static bool is_trailing(char c) {
+  return c == '\n' || c == '\r' || (c == ' ' && spec.collapse_spaces) ? true : false;
+}
+
+int comp_stream_feed(comp_stream *stream, const char *data, size_t len) {
+  const comp_reference *ref = stream->ref;
+  size_t total = ref->norm.prefix[ref->norm.num_chunks], n, end;
+  if (len == 0)
+    return 0;
+  if (stream->exact) {
+    if (stream->pos + len > (size_t) ref->len || kernels->mismatch(ref->data + stream->pos, data, len) < len)
+      stream->exact = false;
+  }
+  stream->pos += len;
+  reserve(stream, len);
+  if (spec.tolerance >= 0) {
+    memcpy(stream->buffer + stream->pending, data, len);
+    stream->pending += len;
+    return 0;
+  }
+  if (!stream->norm)
+    return stream->exact ? 0 : 1;
+  n = stream->pending + compact(stream->buffer + stream->pending, data, len, stream->after_space);
+  stream->after_space = norm_table[(unsigned char) data[len - 1]] & ENTRY_SPACE ? true : false;
+  for (end = n; spec.trailing_newlines && end > 0 && is_trailing(stream->buffer[end - 1]); end--);
+  if (end > 0) {
+    if (stream->norm_pos + end > total || buffer_mismatch(&ref->norm, stream->norm_pos, stream->buffer, end) < end)
+      stream->norm = false;
+    stream->norm_pos += end;
+    memmove(stream->buffer, stream->buffer + end, n - end);
+  }
+  stream->pending = n - end;
+  return stream->exact || stream->norm ? 0 : 1;
+}
+
+diff comp_stream_close(comp_stream *stream) {
+  const comp_reference *ref = stream->ref;
+  diff difference;
+  if (stream->exact && stream->pos == (size_t) ref->len)
+    difference = IDENTICAL;
+  else if (spec.tolerance >= 0)
+    difference = compare_buffers(ref->data, ref->len, &ref->norm, stream->buffer, (ssize_t) stream->pending, NULL);
+  else
+    difference = stream->norm && stream->norm_pos == ref->norm.prefix[ref->norm.num_chunks] ? SIMILAR : DIFFERENT;
+  free(stream->buffer);
+  free(stream);
+  return difference;
+}
+
+/**
+ * Mixes the next 8 bytes into both lanes of a hash.
+ */
+static inline void hash_word(hash128 *hash, word w) {
+  hash->h[0] = (hash->h[0] ^ w) * FP_PRIME_1;
+  hash->h[0] ^= hash->h[0] >> 32;
+  hash->h[1] = (hash->h[1] ^ ((w << 23) | (w >> 41))) * FP_PRIME_2;
+  hash->h[1] ^= hash->h[1] >> 29;
+}
+
+/**
+ * Adds bytes to a hash, 8 at a time. Bytes that don't fill a word wait in the tail.
+ * @param hash Hash to add to.
+ * @param data Bytes to add.
+ * @param len Number of bytes.
+ */
+static void hash_update(hash128 *hash, const char *data, size_t len) {
+  size_t n;
+  word w;
+  hash->len += len;
+  if (hash->tail_len) {
+    n = len < 8 - hash->tail_len ? len : 8 - hash->tail_len;
+    memcpy(hash->tail + hash->tail_len, data, n);
+    hash->tail_len += n;
+    data += n;
+    len -= n;
+    if (hash->tail_len < 8)
+      return;
+    memcpy(&w, hash->tail, 8);
+    hash_word(hash, w);
+    hash->tail_len = 0;
+  }
+  for (; len >= 8; data += 8, len -= 8) {
+    memcpy(&w, data, 8);
+    hash_word(hash, w);
+  }
+  memcpy(hash->tail, data, len);
+  hash->tail_len = len;
+}
+
+/**
+ * Finishes a hash: adds the tail and the length, and mixes every bit of the lanes into all of them.
+ * @param hash Hash to finish, copied so it can go on.
+ * @param out Set to the 128 bits.
+ */
+static void hash_final(hash128 hash, word *out) {
+  word w = 0;
+  register int i;
+  memcpy(&w, hash.tail, hash.tail_len);
+  hash_word(&hash, w);
+  hash_word(&hash, hash.len);
+  for (i = 0; i < 2; i++) {
+    out[i] = hash.h[i] ^ hash.h[1 - i] >> 31;
+    out[i] = (out[i] ^ (out[i] >> 33)) * 0xFF51AFD7ED558CCDULL;
+    out[i] = (out[i] ^ (out[i] >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+    out[i] ^= out[i] >> 33;
+  }
+}
+
+/**
+ * Fingerprints a buffer in one pass: every block is hashed, then compacted by spec and hashed
+ * again. With the eol rule the normalized hash is taken before the last run of trailing bytes.
+ * @param buffer Content of the file.
+ * @param len Length of the buffer.
+ * @param fp Set to the fingerprint.
+ */
+void fingerprint_buffer(const char *buffer, size_t len, fingerprint *fp) {
+  hash128 exact = {.h = {FNV_OFFSET, FP_PRIME_1}}, norm = {.h = {FNV_OFFSET, FP_PRIME_2}}, settled;
+  char block[FP_BLOCK_SIZE];
+  size_t pos, size, n, end;
+  bool after_space = false;
+  init_once();
+  settled = norm;
+  for (pos = 0; pos < len; pos += size) {
+    size = len - pos < FP_BLOCK_SIZE ? len - pos : FP_BLOCK_SIZE;
+    hash_update(&exact, buffer + pos, size);
+    n = compact(block, buffer + pos, size, after_space);
+    after_space = norm_table[(unsigned char) buffer[pos + size - 1]] & ENTRY_SPACE ? true : false;
+    for (end = n; spec.trailing_newlines && end > 0 && is_trailing(block[end - 1]); end--);
+    hash_update(&norm, block, end);
+    if (end > 0 || !spec.trailing_newlines)
+      settled = norm;
+    hash_update(&norm, block + end, n - end);
+  }
+  hash_final(exact, fp->exact);
+  hash_final(spec.trailing_newlines ? settled : norm, fp->norm);
+}
+
+/**
+ * Judges a candidate from fingerprints.
+ * @param ref Fingerprint of the expected output.
+ * @param fp Fingerprint of the candidate.
+ * @return IDENTICAL or SIMILAR if the hashes match, DIFFERENT if only a full comparison can tell.
+ */
+static diff fingerprint_verdict(const fingerprint *ref, const fingerprint *fp) {
+  if (ref->exact[0] == fp->exact[0] && ref->exact[1] == fp->exact[1])
+    return IDENTICAL;
+  if (ref->norm[0] == fp->norm[0] && ref->norm[1] == fp->norm[1])
+    return SIMILAR;
+  return DIFFERENT;
+}
+
+/**
+ * Hashes the spec, fingerprints taken under another spec are not reused.
+ */
+static word spec_key() {
+  word key = FNV_OFFSET;
+  const unsigned char *bytes = (const unsigned char *) &spec;
+  register size_t i;
+  for (i = 0; i < sizeof(spec); i++)
+    key = (key ^ bytes[i]) * FNV_PRIME;
+  return key;
+}
+
+/**
+ * Hashes a path to its first slot in the sidecar table.
+ */
+static size_t sidecar_slot(const char *path) {
+  word key = FNV_OFFSET;
+  for (; *path; path++)
+    key = (key ^ (unsigned char) *path) * FNV_PRIME;
+  return (size_t) key & (sidecar.num_slots - 1);
+}
+
+/**
+ * Finds the entry of a path in the sidecar.
+ * @return Index of the entry, -1 if the path has none.
+ */
+static ssize_t sidecar_find(const char *path) {
+  register size_t slot;
+  if (!sidecar.num_slots)
+    return ERROR_RESULT;
+  for (slot = sidecar_slot(path); sidecar.slots[slot]; slot = (slot + 1) & (sidecar.num_slots - 1))
+    if (!strcmp(sidecar.entries[sidecar.slots[slot] - 1].path, path))
+      return (ssize_t) sidecar.slots[slot] - 1;
+  return ERROR_RESULT;
+}
+
+/**
+ * Adds an entry to the sidecar, or replaces the one of the same path. The table is kept at most
+ * half full.
+ * @param entry Entry to add, the sidecar takes its path.
+ */
+static void sidecar_put(sidecar_entry *entry) {
+  ssize_t found = sidecar_find(entry->path);
+  register size_t i, slot;
+  sidecar.dirty = true;
+  if (found != ERROR_RESULT) {
+    free(sidecar.entries[found].path);
+    sidecar.entries[found] = *entry;
+    return;
+  }
+  if (sidecar.num == sidecar.capacity) {
+    sidecar.capacity = sidecar.capacity ? 2 * sidecar.capacity : BUFFER_SIZE;
+    sidecar.entries = realloc(sidecar.entries, sidecar.capacity * sizeof(sidecar_entry));
+    check_allocation(sidecar.entries);
+  }
+  sidecar.entries[sidecar.num++] = *entry;
+  if (2 * sidecar.num > sidecar.num_slots) {
+    free(sidecar.slots);
+    sidecar.num_slots = sidecar.num_slots ? 2 * sidecar.num_slots : 2 * BUFFER_SIZE;
+    sidecar.slots = calloc(sidecar.num_slots, sizeof(size_t));
+    check_allocation(sidecar.slots);
+    for (i = 0; i < sidecar.num; i++) {
+      for (slot = sidecar_slot(sidecar.entries[i].path); sidecar.slots[slot];)
+        slot = (slot + 1) & (sidecar.num_slots - 1);
+      sidecar.slots[slot] = i + 1;
     }
-    b[j++] = (char) tolower(file2[i]);
+    return;
+  }
+  for (slot = sidecar_slot(entry->path); sidecar.slots[slot];)
+    slot = (slot + 1) & (sidecar.num_slots - 1);
+  sidecar.slots[slot] = sidecar.num;
+}
+
+/**
+ * Writes the sidecar next to itself and renames it over, if anything changed.
+ * @return 0, -1 if it can't be written.
+ */
+static int sidecar_save() {
+  char *tmp;
+  FILE *file;
+  register size_t i;
+  if (!sidecar.dirty)
+    return 0;
+  tmp = malloc(strlen(sidecar.path) + NUMBER_SIZE);
+  check_allocation(tmp);
+  sprintf(tmp, "%s.%d", sidecar.path, (int) getpid());
+  if (!(file = fopen(tmp, "w"))) {
+    free(tmp);
+    return ERROR_RESULT;
+  }
+  for (i = 0; i < sidecar.num; i++) {
+    const sidecar_entry *entry = &sidecar.entries[i];
+    fprintf(file, SIDECAR_FORMAT, entry->spec_key, entry->fp.exact[0], entry->fp.exact[1], entry->fp.norm[0],
+            entry->fp.norm[1], entry->size, entry->mtime_ns, entry->path);
   }
-  // Compare
-  for (i = 0, j = 0; i < max_len && j < max_len; i++, j++) {
-    if (a[i] != b[j]) {
-      return false;
+  if (fclose(file) == EOF || rename(tmp, sidecar.path) < 0) {
+    unlink(tmp);
+    free(tmp);
+    return ERROR_RESULT;
+  }
+  free(tmp);
+  sidecar.dirty = false;
+  return 0;
+}
+
+int comp_set_cache(const char *path) {
+  char *line = NULL, *name;
+  size_t line_size = 0;
+  sidecar_entry entry;
+  int result = 0, offset;
+  register size_t i;
+  FILE *file;
+  pthread_mutex_lock(&sidecar_lock);
+  if (sidecar.path) {
+    result = sidecar_save();
+    for (i = 0; i < sidecar.num; i++)
+      free(sidecar.entries[i].path);
+    free(sidecar.entries);
+    free(sidecar.slots);
+    free(sidecar.path);
+    memset(&sidecar, 0, sizeof(sidecar));
+  }
+  if (path) {
+    sidecar.path = strdup(path);
+    check_allocation(sidecar.path);
+    if ((file = fopen(path, "r"))) {
+      while (getline(&line, &line_size, file) > 0) {
+        if (sscanf(line, SIDECAR_SCAN, &entry.spec_key, &entry.fp.exact[0], &entry.fp.exact[1], &entry.fp.norm[0],
+                   &entry.fp.norm[1], &entry.size, &entry.mtime_ns, &offset) != 7)
+          continue;
+        name = line + offset;
+        name[strcspn(name, "\n")] = '\0';
+        entry.path = strdup(name);
+        check_allocation(entry.path);
+        sidecar_put(&entry);
+      }
+      free(line);
+      fclose(file);
+      sidecar.dirty = false;
     }
   }
-  return true;
+  pthread_mutex_unlock(&sidecar_lock);
+  return result;
+}
+
+void comp_set_verify(int full) {
+  verify = full ? true : false;
+}
+
+/**
+ * Gets the fingerprint of a file from the sidecar, while the file keeps its size and mtime.
+ * Otherwise the file is read and fingerprinted, and the sidecar updated.
+ * @param path Path of the file.
+ * @param fp Set to the fingerprint.
+ * @param buffer Set to the content if the file was read, NULL if the sidecar had it.
+ * @return Length of the file, -1 if it can't be read.
+ */
+ssize_t fingerprint_file(const char *path, fingerprint *fp, char **buffer) {
+  int fd = open(path, O_RDONLY);
+  sidecar_entry entry;
+  struct stat info;
+  ssize_t len, found;
+  *buffer = NULL;
+  if (fd < 0)
+    return ERROR_RESULT;
+  if (fstat(fd, &info) < 0) {
+    close(fd);
+    return ERROR_RESULT;
+  }
+  entry.spec_key = spec_key();
+  entry.size = (long long) info.st_size;
+  entry.mtime_ns = info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+  pthread_mutex_lock(&sidecar_lock);
+  found = sidecar_find(path);
+  if (found != ERROR_RESULT && sidecar.entries[found].spec_key == entry.spec_key
+      && sidecar.entries[found].size == entry.size && sidecar.entries[found].mtime_ns == entry.mtime_ns) {
+    *fp = sidecar.entries[found].fp;
+    pthread_mutex_unlock(&sidecar_lock);
+    close(fd);
+    return (ssize_t) entry.size;
+  }
+  pthread_mutex_unlock(&sidecar_lock);
+  len = fd_to_buffer(fd, buffer);
+  close(fd);
+  if (len < 0)
+    return ERROR_RESULT;
+  fingerprint_buffer(*buffer, (size_t) len, fp);
+  // A file that changed while it was read is not cached.
+  if (len != entry.size)
+    return len;
+  entry.fp = *fp;
+  entry.path = strdup(path);
+  check_allocation(entry.path);
+  pthread_mutex_lock(&sidecar_lock);
+  sidecar_put(&entry);
+  pthread_mutex_unlock(&sidecar_lock);
+  return len;
 }
 
 /**
@@ -188,7 +1164,7 @@ bool similar(const char *file1, const char *file2, ssize_t max_len) {
  * @return True if char is space, false otherwise.
  */
 inline bool is_space(char c) {
-  register int i = 0;
+  register size_t i;
   size_t num_of_spaces = sizeof(spaces) / sizeof(char);
   for (i = 0; i < num_of_spaces; i++) {
     if (c == spaces[i]) {
@@ -197,3 +1173,1013 @@ inline bool is_space(char c) {
   }
   return false;
 }
+
+/**
+ * Byte by byte mismatch search. Also used for the tails of the vector kernels.
+ * @param a First buffer.
+ * @param b Second buffer.
+ * @param len Number of bytes to compare.
+ * @return Index of the first different byte, len if the buffers are the same.
+ */
+size_t mismatch_scalar(const char *a, const char *b, size_t len) {
+  register size_t i;
+  for (i = 0; i < len; i++) {
+    if (a[i] != b[i]) {
+      break;
+    }
+  }
+  return i;
+}
+
+/**
+ * Byte by byte compaction: drops spaces and lowers the rest.
+ * @param dst Buffer of at least len bytes.
+ * @param src Buffer to compact.
+ * @param len Length of src.
+ * @return Number of bytes written to dst.
+ */
+size_t compact_scalar(char *dst, const char *src, size_t len) {
+  register size_t i, j;
+  for (i = 0, j = 0; i < len; i++) {
+    if (is_space(src[i])) {
+      continue;
+    }
+    dst[j++] = (char) tolower((unsigned char) src[i]);
+  }
+  return j;
+}
+
+/**
+ * Table driven compaction for any spec: one lookup per byte and no branches, dropped bytes are
+ * written and then overwritten.
+ * @param dst Buffer of at least len bytes.
+ * @param src Buffer to compact.
+ * @param len Length of src.
+ * @param after_space The byte before src is a space, so a run of spaces continues.
+ * @return Number of bytes written to dst.
+ */
+size_t compact_table(char *dst, const char *src, size_t len, bool after_space) {
+  register size_t i, j;
+  register unsigned entry, prev = after_space ? ENTRY_SPACE : 0;
+  for (i = 0, j = 0; i < len; i++) {
+    entry = norm_table[(unsigned char) src[i]];
+    dst[j] = (char) entry;
+    j += !((entry & ENTRY_DROP) | (entry & prev));
+    prev = entry & ENTRY_SPACE;
+  }
+  return j;
+}
+
+/**
+ * Byte by byte new line count.
+ * @param buffer Buffer to count in.
+ * @param len Length of the buffer.
+ * @return Number of new lines.
+ */
+size_t count_scalar(const char *buffer, size_t len) {
+  register size_t i, lines = 0;
+  for (i = 0; i < len; i++)
+    lines += buffer[i] == '\n';
+  return lines;
+}
+
+#ifdef X86_KERNELS
+/**
+ * SSE2 mismatch search, 32 bytes per step.
+ */
+__attribute__((target("sse2")))
+static size_t mismatch_sse2(const char *a, const char *b, size_t len) {
+  register size_t i = 0;
+  unsigned mask;
+  for (; i + 32 <= len; i += 32) {
+    __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i)),
+                                _mm_loadu_si128((const __m128i *) (b + i)));
+    __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i + 16)),
+                                _mm_loadu_si128((const __m128i *) (b + i + 16)));
+    if (_mm_movemask_epi8(_mm_and_si128(lo, hi)) != 0xFFFF) {
+      mask = (unsigned) _mm_movemask_epi8(lo) | (unsigned) _mm_movemask_epi8(hi) << 16;
+      return i + __builtin_ctz(~mask);
+    }
+  }
+  return i + mismatch_scalar(a + i, b + i, len - i);
+}
+
+/**
+ * SSE2 compaction, 16 bytes per step. Blocks without spaces are stored as a whole.
+ */
+__attribute__((target("sse2")))
+static size_t compact_sse2(char *dst, const char *src, size_t len) {
+  register size_t i = 0, j = 0;
+  unsigned keep;
+  char lowered[16];
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+    // ' ' or one of '\t' '\n' '\f' '\r' (9 - 13 without '\v').
+    __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                              _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\v')),
+                                               _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(8)),
+                                                             _mm_cmplt_epi8(v, _mm_set1_epi8(14)))));
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    v = _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A')));
+    keep = ~(unsigned) _mm_movemask_epi8(ws) & 0xFFFF;
+    if (keep == 0xFFFF) {
+      _mm_storeu_si128((__m128i *) (dst + j), v);
+      j += 16;
+      continue;
+    }
+    _mm_storeu_si128((__m128i *) lowered, v);
+    while (keep) {
+      dst[j++] = lowered[__builtin_ctz(keep)];
+      keep &= keep - 1;
+    }
+  }
+  return j + compact_scalar(dst + j, src + i, len - i);
+}
+
+/**
+ * SSE2 new line count, 16 bytes per step.
+ */
+__attribute__((target("sse2")))
+static size_t count_sse2(const char *buffer, size_t len) {
+  register size_t i = 0, lines = 0;
+  for (; i + 16 <= len; i += 16)
+    lines += __builtin_popcount((unsigned) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (buffer + i)), _mm_set1_epi8('\n'))));
+  return lines + count_scalar(buffer + i, len - i);
+}
+
+/**
+ * AVX2 mismatch search, 64 bytes per step.
+ */
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const char *a, const char *b, size_t len) {
+  register size_t i = 0;
+  unsigned long long mask;
+  for (; i + 64 <= len; i += 64) {
+    __m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + i)),
+                                   _mm256_loadu_si256((const __m256i *) (b + i)));
+    __m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + i + 32)),
+                                   _mm256_loadu_si256((const __m256i *) (b + i + 32)));
+    if ((unsigned) _mm256_movemask_epi8(_mm256_and_si256(lo, hi)) != 0xFFFFFFFFu) {
+      mask = (unsigned) _mm256_movemask_epi8(lo) | (unsigned long long) (unsigned) _mm256_movemask_epi8(hi) << 32;
+      return i + __builtin_ctzll(~mask);
+    }
+  }
+  return i + mismatch_sse2(a + i, b + i, len - i);
+}
+
+/**
+ * AVX2 compaction, 32 bytes per step. Blocks without spaces are stored as a whole.
+ */
+__attribute__((target("avx2")))
+static size_t compact_avx2(char *dst, const char *src, size_t len) {
+  register size_t i = 0, j = 0;
+  unsigned keep;
+  char lowered[32];
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+    __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                 _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\v')),
+                                                     _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(8)),
+                                                                      _mm256_cmpgt_epi8(_mm256_set1_epi8(14), v))));
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+    v = _mm256_add_epi8(v, _mm256_and_si256(upper, _mm256_set1_epi8('a' - 'A')));
+    keep = ~(unsigned) _mm256_movemask_epi8(ws);
+    if (keep == 0xFFFFFFFFu) {
+      _mm256_storeu_si256((__m256i *) (dst + j), v);
+      j += 32;
+      continue;
+    }
+    _mm256_storeu_si256((__m256i *) lowered, v);
+    while (keep) {
+      dst[j++] = lowered[__builtin_ctz(keep)];
+      keep &= keep - 1;
+    }
+  }
+  return j + compact_sse2(dst + j, src + i, len - i);
+}
+
+/**
+ * AVX2 new line count, 32 bytes per step.
+ */
+__attribute__((target("avx2,popcnt")))
+static size_t count_avx2(const char *buffer, size_t len) {
+  register size_t i = 0, lines = 0;
+  for (; i + 32 <= len; i += 32)
+    lines += __builtin_popcount((unsigned) _mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (buffer + i)), _mm256_set1_epi8('\n'))));
+  return lines + count_sse2(buffer + i, len - i);
+}
+#endif
+
+const kernel_set kernel_sets[] = {
+    {"scalar", mismatch_scalar, compact_scalar, count_scalar},
+#ifdef X86_KERNELS
+    {"sse2", mismatch_sse2, compact_sse2, count_sse2},
+    {"avx2", mismatch_avx2, compact_avx2, count_avx2},
+#endif
+};
+
+/**
+ * Returns the kernel sets the CPU can run, from slowest to fastest.
+ * @param sets Set to the first kernel set.
+ * @return Number of usable kernel sets.
+ */
+int supported_kernels(const kernel_set **sets) {
+  int num = 1;
+#ifdef X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    num++;
+  if (num == 2 && __builtin_cpu_supports("avx2"))
+    num++;
+#endif
+  *sets = kernel_sets;
+  return num;
+}
+
+/**
+ * Picks the fastest kernel set the CPU supports. Wider compaction isn't always faster: on text
+ * with short words most blocks have a space and are stored byte by byte, so the compaction of
+ * every vector set and the table are timed on a sample of such text and the fastest is used.
+ */
+void init_kernels() {
+  const kernel_set *sets;
+  int num = supported_kernels(&sets), i;
+  char *sample = malloc(CALIBRATION_SIZE), *dst = malloc(CALIBRATION_SIZE);
+  double best, elapsed;
+  unsigned seed = 1;
+  check_allocation(sample);
+  check_allocation(dst);
+  compile_spec();
+  tuned_kernels = sets[num - 1];
+  vector_compact = false;
+  for (i = 0; i < CALIBRATION_SIZE; i++) {
+    seed = seed * 1103515245 + 12345;
+    sample[i] = (char) ((seed >> 16) % 6 == 0 ? ((seed >> 24) % 8 ? ' ' : '\n') : 'A' + (seed >> 16) % 58);
+  }
+  best = time_compact(NULL, sample, dst);
+  for (i = 1; i < num; i++) {
+    if ((elapsed = time_compact(sets[i].compact, sample, dst)) < best) {
+      best = elapsed;
+      tuned_kernels.compact = sets[i].compact;
+      vector_compact = true;
+    }
+  }
+  kernels = &tuned_kernels;
+  free(sample);
+  free(dst);
+}
+
+/**
+ * Times a compaction kernel on a sample, best of CALIBRATION_ROUNDS.
+ * @param kernel Kernel to time, NULL for the table.
+ * @param sample CALIBRATION_SIZE bytes to compact.
+ * @param dst Buffer of CALIBRATION_SIZE bytes.
+ * @return Seconds of the fastest round.
+ */
+static double time_compact(compact_kernel kernel, const char *sample, char *dst) {
+  double best = -1, start, elapsed;
+  int round;
+  for (round = 0; round < CALIBRATION_ROUNDS; round++) {
+    start = now();
+    if (kernel)
+      kernel(dst, sample, CALIBRATION_SIZE);
+    else
+      compact_table(dst, sample, CALIBRATION_SIZE, false);
+    elapsed = now() - start;
+    if (best < 0 || elapsed < best)
+      best = elapsed;
+  }
+  return best;
+}
+
+/**
+ * Compacts by spec. The vector kernels implement the default spec (spaces, case), any other spec
+ * goes through the table.
+ * @param dst Buffer of at least len bytes.
+ * @param src Buffer to compact.
+ * @param len Length of src.
+ * @param after_space The byte before src is a space.
+ * @return Number of bytes written to dst.
+ */
+size_t compact(char *dst, const char *src, size_t len, bool after_space) {
+  if (spec.ignore_spaces && spec.fold_case && vector_compact)
+    return kernels->compact(dst, src, len);
+  return compact_table(dst, src, len, after_space);
+}
+
+/**
+ * Thread body: runs tasks until there are none left.
+ * @param arg The pool.
+ * @return NULL
+ */
+static void *pool_worker(void *arg) {
+  pool_t *pool = (pool_t *) arg;
+  size_t task;
+  while ((task = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->num_tasks)
+    pool->task(pool->ctx, task);
+  return NULL;
+}
+
+/**
+ * Runs num_tasks tasks on up to num_threads threads (the calling thread is one of them)
+ * and returns when all of them are done.
+ * @param task Function to run, gets ctx and the task number.
+ * @param ctx Context of the tasks.
+ * @param num_tasks Number of tasks.
+ */
+void run_tasks(task_fn task, void *ctx, size_t num_tasks) {
+  pool_t pool = {task, ctx, num_tasks, 0};
+  size_t num = num_tasks < (size_t) num_threads ? num_tasks : (size_t) num_threads;
+  pthread_t *threads = NULL;
+  register size_t i;
+  if (num > 1) {
+    threads = malloc((num - 1) * sizeof(pthread_t));
+    check_allocation(threads);
+    for (i = 0; i < num - 1; i++)
+      if (pthread_create(&threads[i], NULL, pool_worker, &pool) != 0)
+        check_sys_call(-1);
+  }
+  pool_worker(&pool);
+  for (i = 0; num > 1 && i < num - 1; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+/**
+ * Lowers found to pos if pos is lower, so every thread sees the first mismatch.
+ */
+static void report_mismatch(size_t *found, size_t pos) {
+  size_t cur = __atomic_load_n(found, __ATOMIC_RELAXED);
+  while (pos < cur && !__atomic_compare_exchange_n(found, &cur, pos, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/**
+ * Compares one chunk of the raw buffers, stopping early once a mismatch before it is found.
+ */
+static void exact_task(void *arg, size_t chunk) {
+  compare_ctx *ctx = (compare_ctx *) arg;
+  size_t pos = chunk * CHUNK_SIZE, end = pos + CHUNK_SIZE, step, m;
+  if (end > ctx->len)
+    end = ctx->len;
+  for (; pos < end; pos += step) {
+    if (__atomic_load_n(&ctx->found, __ATOMIC_RELAXED) < pos)
+      return;
+    step = end - pos < CANCEL_STEP ? end - pos : CANCEL_STEP;
+    m = kernels->mismatch(ctx->a + pos, ctx->b + pos, step);
+    if (ctx->lines) // The step is still in cache, so counting its lines costs no extra pass.
+      ctx->lines[chunk] += kernels->count(ctx->a + pos, m);
+    if (m < step) {
+      report_mismatch(&ctx->found, pos + m);
+      return;
+    }
+  }
+}
+
+/**
+ * Finds the first different byte of two buffers of the same length, in parallel chunks.
+ * @param a First buffer.
+ * @param b Second buffer.
+ * @param len Length of the buffers.
+ * @param line If not NULL, set to the line of the first different byte.
+ * @return Offset of the first different byte, len if the buffers are the same.
+ */
+size_t first_mismatch(const char *a, const char *b, size_t len, size_t *line) {
+  size_t num_chunks = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  compare_ctx ctx = {a, b, NULL, NULL, len, len, NULL};
+  register size_t c;
+  if (line) {
+    ctx.lines = calloc(num_chunks + 1, sizeof(size_t));
+    check_allocation(ctx.lines);
+  }
+  run_tasks(exact_task, &ctx, num_chunks);
+  if (line) {
+    // Chunks up to the mismatch were all counted, later ones may have been cancelled.
+    for (*line = 1, c = 0; c < num_chunks && c <= ctx.found / CHUNK_SIZE; c++)
+      *line += ctx.lines[c];
+    free(ctx.lines);
+  }
+  return ctx.found;
+}
+
+/**
+ * Compacts one chunk of one of the two files. The first tasks belong to norm_a.
+ */
+static void normalize_task(void *arg, size_t task) {
+  compare_ctx *ctx = (compare_ctx *) arg;
+  const norm_t *norm = task < ctx->norm_a->num_chunks ? ctx->norm_a : ctx->norm_b;
+  size_t chunk = norm == ctx->norm_a ? task : task - ctx->norm_a->num_chunks;
+  size_t pos = chunk * CHUNK_SIZE;
+  size_t len = norm->src_len - pos < CHUNK_SIZE ? norm->src_len - pos : CHUNK_SIZE;
+  bool after_space = pos > 0 && norm_table[(unsigned char) norm->src[pos - 1]] & ENTRY_SPACE ? true : false;
+  norm->prefix[chunk + 1] = compact(norm->data + pos, norm->src + pos, len, after_space);
+  if (norm->lines)
+    norm->lines[chunk] = kernels->count(norm->src + pos, len);
+}
+
+/**
+ * Compacts one or two files chunk by chunk in parallel, then turns the chunk lengths to prefix
+ * sums so the compacted chunks can be read as one stream.
+ * @param a First file, src and src_len set.
+ * @param b Second file, src and src_len set, or NULL.
+ */
+void normalize(norm_t *a, norm_t *b) {
+  compare_ctx ctx = {NULL, NULL, a, b, 0, 0, NULL};
+  norm_t *norms[] = {a, b};
+  size_t num = b ? 2 : 1;
+  register size_t i, c;
+  for (i = 0; i < num; i++) {
+    norms[i]->num_chunks = (norms[i]->src_len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    norms[i]->data = malloc(norms[i]->src_len + 1);
+    norms[i]->prefix = calloc(norms[i]->num_chunks + 1, sizeof(size_t));
+    check_allocation(norms[i]->data);
+    check_allocation(norms[i]->prefix);
+    norms[i]->lines = NULL;
+    if (diagnose) {
+      norms[i]->lines = calloc(norms[i]->num_chunks + 1, sizeof(size_t));
+      check_allocation(norms[i]->lines);
+    }
+  }
+  run_tasks(normalize_task, &ctx, a->num_chunks + (b ? b->num_chunks : 0));
+  for (i = 0; i < num; i++) {
+    // Trailing new lines are cut from the last chunks, which may leave them empty.
+    for (c = norms[i]->num_chunks; spec.trailing_newlines && c > 0; c--) {
+      size_t *len = &norms[i]->prefix[c];
+      const char *data = norms[i]->data + (c - 1) * CHUNK_SIZE;
+      while (*len > 0 && (data[*len - 1] == '\n' || data[*len - 1] == '\r'
+          || (data[*len - 1] == ' ' && spec.collapse_spaces)))
+        (*len)--;
+      if (*len > 0)
+        break;
+    }
+    for (c = 0; c < norms[i]->num_chunks; c++)
+      norms[i]->prefix[c + 1] += norms[i]->prefix[c];
+  }
+}
+
+/**
+ * Finds the chunk holding a position of the compacted stream.
+ * @param norm Compacted file.
+ * @param pos Position in the compacted stream, lower than its length.
+ * @return Chunk number.
+ */
+static size_t locate(const norm_t *norm, size_t pos) {
+  size_t lo = 0, hi = norm->num_chunks, mid;
+  while (hi - lo > 1) {
+    mid = (lo + hi) / 2;
+    if (norm->prefix[mid] <= pos)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * Compares len bytes of two compacted streams from pa and pb, moving across the chunk boundaries
+ * of both files.
+ * @param a First compacted file.
+ * @param pa Position in the first stream.
+ * @param b Second compacted file.
+ * @param pb Position in the second stream.
+ * @param len Number of bytes to compare.
+ * @param found If not NULL, give up once a mismatch before pa is found there.
+ * @return Number of equal bytes, len if all are equal or the compare was given up.
+ */
+static size_t stream_mismatch(const norm_t *a, size_t pa, const norm_t *b, size_t pb, size_t len, size_t *found) {
+  size_t ca, cb, run, m, done;
+  if (len == 0)
+    return 0;
+  ca = locate(a, pa);
+  cb = locate(b, pb);
+  for (done = 0; done < len; done += run) {
+    if (found && __atomic_load_n(found, __ATOMIC_RELAXED) < pa + done)
+      return len;
+    while (a->prefix[ca + 1] <= pa + done)
+      ca++;
+    while (b->prefix[cb + 1] <= pb + done)
+      cb++;
+    run = len - done;
+    if (a->prefix[ca + 1] - (pa + done) < run)
+      run = a->prefix[ca + 1] - (pa + done);
+    if (b->prefix[cb + 1] - (pb + done) < run)
+      run = b->prefix[cb + 1] - (pb + done);
+    m = kernels->mismatch(a->data + ca * CHUNK_SIZE + (pa + done - a->prefix[ca]),
+                          b->data + cb * CHUNK_SIZE + (pb + done - b->prefix[cb]), run);
+    if (m < run)
+      return done + m;
+  }
+  return len;
+}
+
+/**
+ * Compares len bytes of a compacted stream from pos with a buffer.
+ * @param norm Compacted file, at least pos + len bytes long.
+ * @param pos Position in the compacted stream.
+ * @param buffer Bytes to compare.
+ * @param len Number of bytes to compare, more than 0.
+ * @return Number of equal bytes.
+ */
+static size_t buffer_mismatch(const norm_t *norm, size_t pos, const char *buffer, size_t len) {
+  size_t c = locate(norm, pos), done, run, m;
+  for (done = 0; done < len; done += run) {
+    while (norm->prefix[c + 1] <= pos + done)
+      c++;
+    run = len - done;
+    if (norm->prefix[c + 1] - (pos + done) < run)
+      run = norm->prefix[c + 1] - (pos + done);
+    m = kernels->mismatch(norm->data + c * CHUNK_SIZE + (pos + done - norm->prefix[c]), buffer + done, run);
+    if (m < run)
+      return done + m;
+  }
+  return len;
+}
+
+/**
+ * Compares one CHUNK_SIZE range of the compacted streams.
+ */
+static void norm_task(void *arg, size_t task) {
+  compare_ctx *ctx = (compare_ctx *) arg;
+  size_t pos = task * CHUNK_SIZE, len = ctx->len - pos < CHUNK_SIZE ? ctx->len - pos : CHUNK_SIZE, m;
+  m = stream_mismatch(ctx->norm_a, pos, ctx->norm_b, pos, len, &ctx->found);
+  if (m < len)
+    report_mismatch(&ctx->found, pos + m);
+}
+
+/**
+ * Finds the first difference of two compacted files.
+ * @param a First compacted file.
+ * @param b Second compacted file.
+ * @return Position of the first difference in the compacted stream, the shorter length if none.
+ */
+size_t first_norm_mismatch(const norm_t *a, const norm_t *b) {
+  size_t len = a->prefix[a->num_chunks] < b->prefix[b->num_chunks] ? a->prefix[a->num_chunks]
+                                                                    : b->prefix[b->num_chunks];
+  compare_ctx ctx = {NULL, NULL, a, b, len, len, NULL};
+  run_tasks(norm_task, &ctx, (len + CHUNK_SIZE - 1) / CHUNK_SIZE);
+  return ctx.found;
+}
+
+/**
+ * Byte of a compacted stream.
+ */
+static char norm_at(const norm_t *norm, size_t pos) {
+  size_t c = locate(norm, pos);
+  while (norm->prefix[c + 1] <= pos)
+    c++;
+  return norm->data[c * CHUNK_SIZE + pos - norm->prefix[c]];
+}
+
+/**
+ * Checks if a byte can be part of a number. strchr finds the terminator too, so a NUL in the
+ * data is ruled out first.
+ */
+static bool is_number_char(char c) {
+  return c != '\0' && strchr(NUMBER_CHARS, c) ? true : false;
+}
+
+/**
+ * Reads a number from a compacted stream.
+ * @param norm Compacted file.
+ * @param pos Where the number starts.
+ * @param value Set to the number.
+ * @return Where the number ends, pos if there is no number there.
+ */
+static size_t read_number(const norm_t *norm, size_t pos, double *value) {
+  char number[NUMBER_SIZE], *end;
+  size_t len = norm->prefix[norm->num_chunks], i;
+  for (i = 0; i < NUMBER_SIZE - 1 && pos + i < len && is_number_char(norm_at(norm, pos + i)); i++)
+    number[i] = norm_at(norm, pos + i);
+  number[i] = '\0';
+  *value = strtod(number, &end);
+  return pos + (size_t) (end - number);
+}
+
+/**
+ * Compares two compacted streams where numbers are equal within spec.tolerance. Text is compared
+ * with the mismatch kernel; only at a mismatch inside a number are the numbers parsed, and then
+ * each stream continues after its own number.
+ * @param a First compacted file.
+ * @param b Second compacted file.
+ * @param pos If not NULL, set to where the streams first differ, in each of them.
+ * @return True if the streams are equal.
+ */
+bool similar_numbers(const norm_t *a, const norm_t *b, size_t *pos) {
+  size_t len_a = a->prefix[a->num_chunks], len_b = b->prefix[b->num_chunks];
+  size_t pa = 0, pb = 0, start_a, start_b, end_a, end_b, run;
+  double x, y;
+  bool ret;
+  for (;;) {
+    run = len_a - pa < len_b - pb ? len_a - pa : len_b - pb;
+    run = stream_mismatch(a, pa, b, pb, run, NULL);
+    pa += run;
+    pb += run;
+    if ((ret = pa == len_a && pb == len_b ? true : false))
+      break;
+    // The bytes before the mismatch are equal, so both numbers start the same distance back.
+    // They are backed up over the whole token read_number reads, exponent and signs included,
+    // and the first start whose number reaches the mismatch is compared.
+    for (start_a = pa, start_b = pb; start_a > 0 && start_b > 0 && pa - start_a < NUMBER_SIZE - 1
+         && is_number_char(norm_at(a, start_a - 1)); start_a--, start_b--);
+    for (;; start_a++, start_b++) {
+      end_a = read_number(a, start_a, &x);
+      end_b = read_number(b, start_b, &y);
+      if (start_a == pa || (end_a >= pa && end_b >= pb && (end_a > pa || end_b > pb)))
+        break;
+    }
+    if (end_a == start_a || end_b == start_b || end_a < pa || end_b < pb || (end_a == pa && end_b == pb)
+        || fabs(x - y) > spec.tolerance)
+      break;
+    pa = end_a;
+    pb = end_b;
+  }
+  if (pos) {
+    pos[0] = pa;
+    pos[1] = pb;
+  }
+  return ret;
+}
+
+/**
+ * Maps a position of the compacted stream back to the source file. Only the chunk holding it
+ * is scanned again, the lines of the chunks before it were counted while compacting.
+ * @param norm Compacted file, compacted while diagnosing.
+ * @param pos Position in the compacted stream, its length for the end of the file.
+ * @return Position in the source file.
+ */
+position norm_position(const norm_t *norm, size_t pos) {
+  position ret = {norm->src_len, 1, 0};
+  register size_t c, i, kept;
+  register unsigned entry, prev;
+  size_t chunk = norm->num_chunks;
+  if (pos < norm->prefix[norm->num_chunks]) {
+    chunk = locate(norm, pos);
+    while (norm->prefix[chunk + 1] <= pos)
+      chunk++;
+  }
+  for (c = 0; c < chunk; c++)
+    ret.line += norm->lines[c];
+  if (chunk < norm->num_chunks) {
+    i = chunk * CHUNK_SIZE;
+    prev = i > 0 ? norm_table[(unsigned char) norm->src[i - 1]] & ENTRY_SPACE : 0;
+    for (kept = norm->prefix[chunk];; i++) {
+      entry = norm_table[(unsigned char) norm->src[i]];
+      if (!((entry & ENTRY_DROP) | (entry & prev)) && kept++ == pos)
+        break;
+      prev = entry & ENTRY_SPACE;
+      if (norm->src[i] == '\n')
+        ret.line++;
+    }
+    ret.offset = i;
+  }
+  ret.column = column_of(norm->src, ret.offset);
+  return ret;
+}
+
+/**
+ * Frees what normalize allocated.
+ * @param norm Compacted file.
+ */
+void free_norm(norm_t *norm) {
+  free(norm->data);
+  free(norm->prefix);
+  free(norm->lines);
+}
+
+/**
+ * One column step of Myers' bit-vector algorithm over a block of 64 rows (Hyyrö's formulation).
+ * @param pv Positive vertical deltas of the block, updated.
+ * @param mv Negative vertical deltas of the block, updated.
+ * @param eq Rows of the block that match the current symbol.
+ * @param hin Horizontal delta coming into the top of the block.
+ * @param out_bit Row whose horizontal delta is returned.
+ * @return Horizontal delta at out_bit.
+ */
+static int advance_block(word *pv, word *mv, word eq, int hin, word out_bit) {
+  word xv = eq | *mv, xh, ph, mh;
+  int hout = 0;
+  if (hin < 0)
+    eq |= 1;
+  xh = (((eq & *pv) + *pv) ^ *pv) | eq;
+  ph = *mv | ~(xh | *pv);
+  mh = *pv & xh;
+  if (ph & out_bit)
+    hout = 1;
+  if (mh & out_bit)
+    hout = -1;
+  ph <<= 1;
+  mh <<= 1;
+  if (hin < 0)
+    mh |= 1;
+  else if (hin > 0)
+    ph |= 1;
+  *pv = mh | ~(xv | ph);
+  *mv = ph & xv;
+  return hout;
+}
+
+/**
+ * Levenshtein distance of two symbol sequences, if it is at most k. Only the blocks of 64 rows
+ * that cross the diagonal band |row - column| <= k are computed, since any alignment of cost k
+ * stays inside it. The match vectors are a dense table for small alphabets, otherwise they are
+ * built per column from the sorted rows of each symbol.
+ * @param a First sequence (rows).
+ * @param m Length of a.
+ * @param b Second sequence (columns).
+ * @param n Length of b.
+ * @param alphabet Symbols are below this.
+ * @param k Band limit.
+ * @return The distance, k + 1 if it is more than k.
+ */
+size_t edit_distance(const unsigned *a, size_t m, const unsigned *b, size_t n, unsigned alphabet, size_t k) {
+  size_t num_blocks = (m + WORD_BITS - 1) / WORD_BITS, first = 0, last, bl, j, i, d;
+  bool dense = (size_t) alphabet * num_blocks <= DENSE_PEQ_WORDS ? true : false;
+  word *pv, *mv, *peq, *eq = NULL;
+  size_t *score, *occ = NULL, *occ_start = NULL, *p, *end;
+  int hin;
+  if ((m > n ? m - n : n - m) > k)
+    return k + 1;
+  if (m == 0 || n == 0)
+    return m + n;
+
+  pv = malloc(num_blocks * sizeof(word));
+  mv = calloc(num_blocks, sizeof(word));
+  score = malloc(num_blocks * sizeof(size_t));
+  peq = calloc(dense ? (size_t) alphabet * num_blocks : num_blocks, sizeof(word));
+  check_allocation(pv);
+  check_allocation(mv);
+  check_allocation(score);
+  check_allocation(peq);
+  if (dense) {
+    for (i = 0; i < m; i++)
+      peq[a[i] * num_blocks + i / WORD_BITS] |= 1ULL << (i % WORD_BITS);
+  } else { // Rows of every symbol, sorted, counting sort.
+    eq = peq;
+    occ = malloc(m * sizeof(size_t));
+    occ_start = calloc((size_t) alphabet + 2, sizeof(size_t));
+    check_allocation(occ);
+    check_allocation(occ_start);
+    for (i = 0; i < m; i++)
+      occ_start[a[i] + 2]++;
+    for (i = 2; i < (size_t) alphabet + 2; i++)
+      occ_start[i] += occ_start[i - 1];
+    for (i = 0; i < m; i++)
+      occ[occ_start[a[i] + 1]++] = i;
+  }
+
+  // Column 0 is the distance to the empty prefix: every vertical delta is +1.
+  for (bl = 0; bl < num_blocks; bl++) {
+    pv[bl] = ~0ULL;
+    score[bl] = (bl + 1) * WORD_BITS < m ? (bl + 1) * WORD_BITS : m;
+  }
+  last = k / WORD_BITS < num_blocks - 1 ? k / WORD_BITS : num_blocks - 1;
+  for (j = 1; j <= n; j++) {
+    // Blocks entering the band start from an upper bound: +1 per row below the block above.
+    while (last < num_blocks - 1 && last < (j + k - 1) / WORD_BITS) {
+      last++;
+      pv[last] = ~0ULL;
+      mv[last] = 0;
+      score[last] = score[last - 1] + (last == num_blocks - 1 ? m - last * WORD_BITS : WORD_BITS);
+    }
+    // Blocks leaving the band are dropped, the row above the first block then grows by 1.
+    if (j > k + 1 && (j - k - 1) / WORD_BITS > first)
+      first = (j - k - 1) / WORD_BITS;
+    if (!dense) {
+      memset(eq + first, 0, (last - first + 1) * sizeof(word));
+      if (b[j - 1] < alphabet) {
+        p = occ + occ_start[b[j - 1]];
+        end = occ + occ_start[b[j - 1] + 1];
+        while (p < end && *p < first * WORD_BITS)
+          p++;
+        for (; p < end && *p < (last + 1) * WORD_BITS; p++)
+          eq[*p / WORD_BITS] |= 1ULL << (*p % WORD_BITS);
+      }
+    }
+    for (hin = 1, bl = first; bl <= last; bl++) {
+      word match = dense ? (b[j - 1] < alphabet ? peq[b[j - 1] * num_blocks + bl] : 0) : eq[bl];
+      word out_bit = bl == num_blocks - 1 ? 1ULL << ((m - 1) % WORD_BITS) : HIGH_BIT;
+      hin = advance_block(&pv[bl], &mv[bl], match, hin, out_bit);
+      score[bl] += hin;
+    }
+  }
+  d = score[num_blocks - 1];
+
+  free(pv);
+  free(mv);
+  free(score);
+  free(peq);
+  free(occ);
+  free(occ_start);
+  return d <= k ? d : k + 1;
+}
+
+/**
+ * Splits a file to lines and hashes every line after compaction, skipping lines that are empty
+ * after compaction.
+ * @param src Content of the file.
+ * @param len Length of the file.
+ * @param hashes Set to the hashes, to free.
+ * @return Number of lines.
+ */
+static size_t hash_lines(const char *src, size_t len, unsigned long long **hashes) {
+  size_t size = 1 + len / 16, num = 0;
+  register size_t i;
+  unsigned long long hash = FNV_OFFSET;
+  register unsigned entry, prev = 0;
+  bool empty = true;
+  *hashes = malloc(size * sizeof(unsigned long long));
+  check_allocation(*hashes);
+  for (i = 0; i <= len; i++) {
+    if (i == len || src[i] == '\n') {
+      if (!empty) {
+        if (num == size) {
+          size *= 2;
+          *hashes = realloc(*hashes, size * sizeof(unsigned long long));
+          check_allocation(*hashes);
+        }
+        (*hashes)[num++] = hash;
+      }
+      hash = FNV_OFFSET;
+      empty = true;
+      prev = 0;
+    } else {
+      entry = norm_table[(unsigned char) src[i]];
+      if (!((entry & ENTRY_DROP) | (entry & prev))) {
+        hash = (hash ^ (entry & 0xFF)) * FNV_PRIME;
+        empty = entry & ENTRY_SPACE ? empty : false;
+      }
+      prev = entry & ENTRY_SPACE;
+    }
+  }
+  return num;
+}
+
+/**
+ * Turns the line hashes of both files to small symbol numbers, equal hashes to equal symbols.
+ * @param hashes Hashes of both files, one after the other.
+ * @param num Number of hashes.
+ * @param symbols Filled with the symbols.
+ * @return Number of different symbols.
+ */
+static unsigned intern(const unsigned long long *hashes, size_t num, unsigned *symbols) {
+  size_t size = 16, mask, i, slot;
+  unsigned next = 0;
+  unsigned long long *keys;
+  unsigned *values;
+  while (size < 2 * num)
+    size *= 2;
+  mask = size - 1;
+  keys = malloc(size * sizeof(unsigned long long));
+  values = malloc(size * sizeof(unsigned));
+  check_allocation(keys);
+  check_allocation(values);
+  memset(values, 0xFF, size * sizeof(unsigned));
+  for (i = 0; i < num; i++) {
+    for (slot = (size_t) (hashes[i] ^ hashes[i] >> 29) & mask;
+         values[slot] != ~0U && keys[slot] != hashes[i]; slot = (slot + 1) & mask);
+    if (values[slot] == ~0U) {
+      keys[slot] = hashes[i];
+      values[slot] = next++;
+    }
+    symbols[i] = values[slot];
+  }
+  free(keys);
+  free(values);
+  return next;
+}
+
+/**
+ * Similarity of two files between 0 and 1: one minus the edit distance of the compacted files
+ * over the longer length. Short files are compared per character, long files per compacted line.
+ * The common prefix and suffix are skipped, and the band limit starts small and doubles, so
+ * near misses cost time in proportion to their distance. Files too far apart to finish within
+ * SCORE_WORK_LIMIT block steps are scored as below the floor.
+ * @param file1 First buffer.
+ * @param file1_len Length of the first buffer.
+ * @param file2 Second buffer.
+ * @param file2_len Length of the second buffer.
+ * @param floor Scores below this are reported as 0, which bounds the band.
+ * @return The score.
+ */
+double score_buffers(const char *file1, ssize_t file1_len, const char *file2, ssize_t file2_len, double floor) {
+  char *a = malloc((size_t) file1_len + 1), *b = malloc((size_t) file2_len + 1);
+  unsigned long long *hashes1, *hashes2, *hashes;
+  unsigned *symbols, alphabet = 256;
+  size_t m, n, longest, pre = 0, post = 0, limit, k, d;
+  register size_t i;
+  check_allocation(a);
+  check_allocation(b);
+  m = compact(a, file1, (size_t) file1_len, false);
+  n = compact(b, file2, (size_t) file2_len, false);
+  if (m <= CHAR_SCORE_LIMIT && n <= CHAR_SCORE_LIMIT) {
+    symbols = malloc((m + n + 1) * sizeof(unsigned));
+    check_allocation(symbols);
+    for (i = 0; i < m; i++)
+      symbols[i] = (unsigned char) a[i];
+    for (i = 0; i < n; i++)
+      symbols[m + i] = (unsigned char) b[i];
+  } else {
+    m = hash_lines(file1, (size_t) file1_len, &hashes1);
+    n = hash_lines(file2, (size_t) file2_len, &hashes2);
+    hashes = malloc((m + n + 1) * sizeof(unsigned long long));
+    symbols = malloc((m + n + 1) * sizeof(unsigned));
+    check_allocation(hashes);
+    check_allocation(symbols);
+    memcpy(hashes, hashes1, m * sizeof(unsigned long long));
+    memcpy(hashes + m, hashes2, n * sizeof(unsigned long long));
+    alphabet = intern(hashes, m + n, symbols);
+    free(hashes1);
+    free(hashes2);
+    free(hashes);
+  }
+  free(a);
+  free(b);
+
+  longest = m > n ? m : n;
+  if (longest == 0) {
+    free(symbols);
+    return 1;
+  }
+  while (pre < m && pre < n && symbols[pre] == symbols[m + pre])
+    pre++;
+  while (post < m - pre && post < n - pre && symbols[m - 1 - post] == symbols[m + n - 1 - post])
+    post++;
+  limit = (size_t) ((1 - floor) * longest);
+  k = m > n ? m - n : n - m;
+  if (k < WORD_BITS)
+    k = WORD_BITS;
+  for (;; k *= 2) {
+    if (k > limit)
+      k = limit;
+    if ((n - pre - post) * (2 * k / WORD_BITS + 2) > SCORE_WORK_LIMIT) {
+      d = limit + 1;
+      break;
+    }
+    d = edit_distance(symbols + pre, m - pre - post, symbols + m + pre, n - pre - post, alphabet, k);
+    if (d <= k || k == limit)
+      break;
+  }
+  free(symbols);
+  return d > limit ? 0 : 1 - (double) d / longest;
+}
+
+/**
+ * Seconds since some fixed point, for the benchmark and the kernel calibration.
+ */
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Measures every supported kernel set (the scalar set is the original byte loop) on a buffer
+ * and prints the throughput of identical() and similar() work in MB/s, and of fingerprinting,
+ * then the compaction init_kernels picked.
+ * @param buffer File content.
+ * @param len Length of the buffer.
+ */
+void benchmark(const char *buffer, ssize_t len) {
+  const kernel_set *sets;
+  int num = supported_kernels(&sets), i;
+  char *copy = malloc((size_t) len + 1);
+  char *compacted = malloc((size_t) len + 1);
+  double start, elapsed, mb = len / 1e6;
+  long rounds;
+  size_t sink = 0;
+  fingerprint fp;
+  check_allocation(copy);
+  check_allocation(compacted);
+  memcpy(copy, buffer, (size_t) len);
+
+  printf("%-8s %14s %14s\n", "kernel", "identical MB/s", "similar MB/s");
+  for (i = 0; i < num; i++) {
+    printf("%-8s", sets[i].name);
+    for (rounds = 0, start = now(); (elapsed = now() - start) < BENCH_SECONDS; rounds++)
+      sink += sets[i].mismatch(buffer, copy, (size_t) len);
+    printf(" %14.1f", mb * rounds / elapsed);
+    for (rounds = 0, start = now(); (elapsed = now() - start) < BENCH_SECONDS; rounds++)
+      sink += sets[i].compact(compacted, buffer, (size_t) len);
+    printf(" %14.1f\n", mb * rounds / elapsed);
+  }
+  printf("%-8s %14s", "table", "-");
+  for (rounds = 0, start = now(); (elapsed = now() - start) < BENCH_SECONDS; rounds++)
+    sink += compact_table(compacted, buffer, (size_t) len, false);
+  printf(" %14.1f\n", mb * rounds / elapsed);
+  printf("%-8s", "hash");
+  for (rounds = 0, start = now(); (elapsed = now() - start) < BENCH_SECONDS; rounds++) {
+    fingerprint_buffer(buffer, (size_t) len, &fp);
+    sink += fp.exact[0] & 1;
+  }
+  printf(" %14.1f %14s\n", mb * rounds / elapsed, "(both)");
+  for (i = 0; i < num && (!vector_compact || sets[i].compact != kernels->compact); i++);
+  printf("%-8s %14s %14s\n", "picked", kernels->name, i < num ? sets[i].name : "table");
+  if (sink == 0 && len)
+    printf("\n");
+
+  free(copy);
+  free(compacted);
+}
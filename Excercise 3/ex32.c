@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <zconf.h>
@@ -5,54 +6,286 @@
 #include <dirent.h>
 #include <wait.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <limits.h>
+#include <stdarg.h>
+#include "comp.h"
 
 #define ERROR           -1
 #define MAX_LENGTH      160
-#define NUM_OF_LINES    3
-#define CSV_WRITE_SIZE  200
+#define MAX_TESTS       64
+#define SINK_FLUSH_SIZE 65536
+#define SINK_FLUSH_MS   1000
+#define ROW_SIZE        128
+#define JOBSERVER_AUTH  "--jobserver-auth="
+#define JOBSERVER_FDS   "--jobserver-fds="
+#define JOBSERVER_FIFO  "fifo:"
+#define FD_PATH_SIZE    64
 #define SYS_CALL_ERROR  "Error in system call\n"
+#define CONFIG_ERROR    "Error in config: %s\n"
 #define C_EXTENSION     "c"
 #define DOT             '.'
 #define COMMA           ","
 #define NEW_LINE        "\n"
 #define COMPILE_GCC     "gcc"
 #define OUT_FILE        "user.out"
-#define OUTPUT_FILE     "output.txt"
 #define DOT_OUT_FILE    "./user.out"
-#define DOT_COMP_FILE   "./comp.out"
-#define DOT_OUTPUT_FILE "./output.txt"
 #define DOT_RESULT_FILE "./results.csv"
+#define TEST_SEP        ";"
+#define SCRATCH_DIR     "/tmp/grade.XXXXXX"
+#define TIMEOUT_SECONDS 5
+#define POLL_MAX_NS     10000000
+#define CACHE_DIR       "./.grade_cache"
+#define STATE_FILE      "./.grade_state"
+#define STATE_FORMAT    "%016llx %016llx %d %s %ld %ld %ld %s\n"
+#define STATE_SCAN      "%llx %llx %d %65s %ld %ld %ld%n" // %65s: the reason and MAX_TESTS verdicts
+#define CACHE_OUT       "out"
+#define CACHE_FAIL      "fail"
+#define COPY_SIZE       65536
+#define PIPE_READ_SIZE  65536
+#define FNV_OFFSET      14695981039346656037ULL
+#define FNV_PRIME       1099511628211ULL
+#define NUM_LIMITS      4
+#define LIMIT_CPU       0
+#define LIMITS_SEP      ","
+#define TIMING_FORMAT   "%-10s %10.1f ms  %s\n"
+#define RUN_FDS         2
+#define SPAWN_FAILED    127
+#define CPU_SLACK_US    50000 // rusage times are sampled on ticks, a cpu limit kill can read under it
 
 const char
-    *reason_arr[] = {"NO_C_FILE", "COMPILATION_ERROR", "TIMEOUT", "BAD_OUTPUT", "SIMILAR_OUTPUT", "GREAT_JOB", "TBD"};
-const char *grade_arr[] = {"0", "0", "0", "60", "80", "100", "101"};
+    *reason_arr[] = {"NO_C_FILE", "COMPILATION_ERROR", "TIMEOUT", "BAD_OUTPUT", "SIMILAR_OUTPUT", "GREAT_JOB",
+                     "PATH_TOO_LONG", "TBD"};
+const char *grade_arr[] = {"0", "0", "0", "60", "80", "100", "0", "101"};
+// Arguments of gcc between the output and the source, part of the cache key.
+const char *compile_flags[] = {NULL};
+// Resource limits of a running submission, set with -l name=value,... (0 for no limit).
+const char *limit_names[] = {"cpu", "mem", "fsize", "nproc"};
+const int limit_resources[] = {RLIMIT_CPU, RLIMIT_AS, RLIMIT_FSIZE, RLIMIT_NPROC};
+const long limit_units[] = {1, 1L << 20, 1L << 20, 1};
+const long limit_defaults[] = {0, 1024, 64, 256}; // No cpu limit means timeout + 1 seconds.
 
 typedef enum bool { false, true } bool;
-typedef enum reason { NO_C_FILE, COMPILATION_ERROR, TIMEOUT, BAD_OUTPUT, SIMILAR_OUTPUT, GREAT_JOB, TBD } reason;
+typedef enum reason {
+  NO_C_FILE, COMPILATION_ERROR, TIMEOUT, BAD_OUTPUT, SIMILAR_OUTPUT, GREAT_JOB, PATH_TOO_LONG, TBD
+} reason;
+
+/**
+ * Resources used by a submission's run, from wait4.
+ */
+typedef struct Usage {
+  bool measured;
+  long user_us;
+  long sys_us;
+  long max_rss_kb;
+} Usage;
 
 typedef struct Student {
-  char folder_name[MAX_LENGTH];
-  char folder_path[MAX_LENGTH];
-  char file_name[MAX_LENGTH];
-  char file_path[MAX_LENGTH];
-  char out_folder[MAX_LENGTH];
+  char folder_name[NAME_MAX + 1];
+  char *folder_path;
+  char file_name[NAME_MAX + 1];
+  char *file_path;    // NULL until a C file is found.
+  char *out_folder;
+  char scratch[MAX_LENGTH];
+  unsigned long long source_hash;
+  bool hashed;
+  char *sources;      // Every .c and .h of the folder: path, size and bytes, to confirm cache hits.
+  size_t sources_len;
+  Usage usage;
+  int grade;
+  reason verdicts[MAX_TESTS];
+  bool cached;
+  bool reused;
+  long long started_ms;
+  long elapsed_ms;
+  long compile_ms;
+  long compile_rss_kb;
+  long run_us;     // Wall time of the runs, from the request to the runner's reply.
+  long compare_us; // CPU time of comparing their output.
   reason reason;
 } Student;
-typedef struct Config {
-  char folders_location[MAX_LENGTH];
+
+/**
+ * Verdict of an earlier run, reused while the source and the test are the same.
+ */
+typedef struct Result {
+  char folder_name[NAME_MAX + 1];
+  unsigned long long source_hash;
+  unsigned long long test_hash;
+  Usage usage;
+  int grade;
+  reason verdicts[MAX_TESTS];
+  reason reason;
+} Result;
+
+/**
+ * A test case, the program reads input_file and should print output_file. Grades of the tests are
+ * averaged by weight.
+ */
+typedef struct Test {
   char input_file[MAX_LENGTH];
   char output_file[MAX_LENGTH];
+  double weight;
+  comp_reference *reference;
+} Test;
+typedef struct Config {
+  char folders_location[MAX_LENGTH];
+  Test tests[MAX_TESTS];
+  int num_tests;
+  char scratch_root[MAX_LENGTH];
+  int workers;
+  int timeout_ms;
+  char cache_dir[MAX_LENGTH];
+  unsigned long long compiler_hash;
+  char state_file[MAX_LENGTH];
+  unsigned long long test_hash;
+  Result *results;
+  int num_results;
+  long limits[NUM_LIMITS];
+  int compilers;
+  char csv_file[MAX_LENGTH];
+  char json_file[MAX_LENGTH];
+  int jobserver;
+  int *runners;
+  pid_t runner_pid;
+  bool timings;
 } Config;
 
+/**
+ * Request of a run worker to the runner, sent with the program's stdin and the write end of its
+ * stdout pipe. The same request without descriptors kills the worker's running program.
+ */
+typedef struct RunRequest {
+  int timeout_ms;
+  long limits[NUM_LIMITS];
+  char scratch[MAX_LENGTH];
+} RunRequest;
+
+/**
+ * Reply of the runner once the program was reaped. timed_out is true if the runner killed it at
+ * its deadline.
+ */
+typedef struct RunReply {
+  bool timed_out;
+  int status;
+  struct rusage usage;
+} RunReply;
+
+/**
+ * A program the runner is running for a worker, pid is 0 when there is none.
+ */
+typedef struct Running {
+  pid_t pid;
+  int pidfd;
+  long long deadline;
+} Running;
+
+/**
+ * Output file of the results sink, rows are appended to data and written in large writes.
+ */
+typedef struct Buffer {
+  int fd;
+  char *data;
+  size_t len;
+  size_t capacity;
+} Buffer;
+
+/**
+ * Results sink. Rows are written in student order as soon as every student before them finished,
+ * and flushed every SINK_FLUSH_SIZE bytes or SINK_FLUSH_MS, so a crash keeps what was graded.
+ */
+typedef struct Sink {
+  const Student *students;
+  int num_of_students;
+  const Config *config;
+  Buffer csv;
+  Buffer json;
+  bool *done;
+  int next;
+  long long flushed_ms;
+  long long write_us;
+  pthread_mutex_t lock;
+} Sink;
+
+/**
+ * A compiler in flight. token is the jobserver byte it holds, or ERROR for the slot every process
+ * gets without a token.
+ */
+typedef struct Build {
+  int student;
+  pid_t pid;
+  int pidfd;
+  int token;
+  long long started_ms;
+} Build;
+
+/**
+ * Shared state of the grading pipeline. The compile farm keeps up to config.compilers compilers
+ * running and queues the students with a program in ready; run workers take them from the queue
+ * and run all the tests, so compiling the next students overlaps running the previous ones.
+ */
+typedef struct Grader {
+  Student *students;
+  int num_of_students;
+  const Config *config;
+  int *ready;
+  int head;
+  int tail;
+  int compiled;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  Sink *sink;
+  int next_runner;
+} Grader;
+
 void error();
-void compile(Student);
-void grade(Student *, int, Config);
+void config_error(const char *);
+void child_error();
+bool compile_cached(Student *, const Config *);
+pid_t compile_start(const Student *);
+void compile_store(Student *, const Config *);
+int open_jobserver();
+unsigned long long hash_bytes(unsigned long long, const char *, size_t);
+bool hash_file(const char *, unsigned long long *);
+bool read_sources(Student *, const char *, const char *);
+void free_sources(Student *);
+unsigned long long compiler_hash();
+bool store_entry(const Student *, const char *, const char *);
+bool load_entry(const Student *, const char *, const char *);
+void load_state(Config *);
+const Result *find_result(const Config *, const Student *);
+void save_state(const Student *, int, const Config *);
+void grade(Student *, int, Config, Sink *);
+bool prepare_student(Student *, const Config *);
+bool finish_build(Student *);
+void run_student(Student *, const Config *, int);
 void parse_config(char *, Config *);
-bool check_for_out();
-reason run(Config config);
-reason compare(Config config);
-Student *check_directories(char *, int *);
-void save_CSV(Student *, int);
+bool copy_path(char *, const char *);
+bool check_for_out(const Student *);
+reason run(Student *, const Config *, const Test *, int);
+bool parse_limits(char *, Config *);
+reason compare(int, const Test *, long long);
+long long now_ms();
+long long now_us();
+long long cpu_us();
+void scratch_path(char *, const Student *, const char *);
+bool send_message(int, const void *, size_t, const int *, int);
+ssize_t recv_message(int, void *, size_t, int *, int *);
+void start_runner(Config *);
+void stop_runner(Config *);
+Student *check_directories(char *, int *, int);
+void sink_open(Sink *, const Student *, int, const Config *);
+void sink_done(Sink *, int);
+void sink_close(Sink *);
+void print_timings(const Student *, int, const Config *, long long, long long, long long);
 
 /**
  * Prints error and exits.
@@ -63,142 +296,1239 @@ void error() {
 }
 
 /**
- * Save the list of students to CSV file with their grade and reason.
+ * Prints what is wrong with the configuration and exits.
+ * @param   message What is wrong.
+ */
+void config_error(const char *message) {
+  fprintf(stderr, CONFIG_ERROR, message);
+  exit(ERROR);
+}
+
+/**
+ * Prints error and exits a forked child, without the atexit handlers and the stdio buffers it
+ * copied from the (threaded) grader.
+ */
+void child_error() {
+  write(2, SYS_CALL_ERROR, strlen(SYS_CALL_ERROR));
+  _exit(SPAWN_FAILED);
+}
+
+/**
+ * Appends to a sink buffer, growing it geometrically.
+ * @param   buffer  Buffer to append to.
+ * @param   data    Bytes to append.
+ * @param   len     Number of bytes.
+ */
+void buffer_append(Buffer *buffer, const char *data, size_t len) {
+  if (buffer->len + len > buffer->capacity) {
+    buffer->capacity = buffer->len + len > 2 * buffer->capacity ? buffer->len + len : 2 * buffer->capacity;
+    if (!(buffer->data = realloc(buffer->data, buffer->capacity)))
+      error();
+  }
+  memcpy(buffer->data + buffer->len, data, len);
+  buffer->len += len;
+}
+
+/**
+ * Appends formatted text to a sink buffer.
+ */
+void buffer_printf(Buffer *buffer, const char *format, ...) {
+  char row[ROW_SIZE];
+  va_list args;
+  int len;
+  va_start(args, format);
+  len = vsnprintf(row, sizeof(row), format, args);
+  va_end(args);
+  if (len >= (int) sizeof(row))
+    error();
+  buffer_append(buffer, row, (size_t) len);
+}
+
+/**
+ * Appends a CSV field, quoted when it holds a comma, a quote or a new line.
+ */
+void buffer_csv(Buffer *buffer, const char *field) {
+  if (!strpbrk(field, ",\"\r\n")) {
+    buffer_append(buffer, field, strlen(field));
+    return;
+  }
+  buffer_append(buffer, "\"", 1);
+  for (; *field; field++)
+    buffer_append(buffer, *field == '"' ? "\"\"" : field, *field == '"' ? 2 : 1);
+  buffer_append(buffer, "\"", 1);
+}
+
+/**
+ * Appends a JSON string.
+ */
+void buffer_json(Buffer *buffer, const char *string) {
+  buffer_append(buffer, "\"", 1);
+  for (; *string; string++) {
+    unsigned char c = (unsigned char) *string;
+    if (c == '"' || c == '\\')
+      buffer_printf(buffer, "\\%c", c);
+    else if (c < ' ')
+      buffer_printf(buffer, "\\u%04x", c);
+    else
+      buffer_append(buffer, string, 1);
+  }
+  buffer_append(buffer, "\"", 1);
+}
+
+/**
+ * Writes out a sink buffer.
+ */
+void buffer_flush(Buffer *buffer) {
+  size_t done = 0;
+  ssize_t num_bytes;
+  while (buffer->fd != ERROR && done < buffer->len) {
+    if ((num_bytes = write(buffer->fd, buffer->data + done, buffer->len - done)) == ERROR) {
+      if (errno == EINTR)
+        continue;
+      error();
+    }
+    done += (size_t) num_bytes;
+  }
+  buffer->len = 0;
+}
+
+/**
+ * Opens the results files, config->csv_file always and config->json_file if set.
+ * @param   sink              Sink to open.
  * @param   students          List of all students.
  * @param   num_of_students   Number of students in the list.
+ * @param   config            Config struct.
+ */
+void sink_open(Sink *sink, const Student *students, int num_of_students, const Config *config) {
+  memset(sink, 0, sizeof(Sink));
+  sink->students = students;
+  sink->num_of_students = num_of_students;
+  sink->config = config;
+  if ((sink->csv.fd = open(config->csv_file, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644)) == ERROR)
+    error();
+  sink->json.fd = ERROR;
+  if (config->json_file[0]
+      && (sink->json.fd = open(config->json_file, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644)) == ERROR)
+    error();
+  if (!(sink->done = calloc((size_t) num_of_students + 1, sizeof(bool))))
+    error();
+  sink->flushed_ms = now_ms();
+  pthread_mutex_init(&sink->lock, NULL);
+}
+
+/**
+ * Adds a student's CSV row: name, grade, reason, user and system seconds, peak memory in KB
+ * (empty if the program didn't run), and with more than one test the reasons of all tests.
+ */
+void sink_csv(Sink *sink, const Student *student) {
+  const Usage *usage = &student->usage;
+  Buffer *csv = &sink->csv;
+  buffer_csv(csv, student->folder_name);
+  buffer_printf(csv, ",%d,%s", student->grade, reason_arr[student->reason]);
+  if (usage->measured)
+    buffer_printf(csv, ",%ld.%06ld,%ld.%06ld,%ld", usage->user_us / 1000000, usage->user_us % 1000000,
+                  usage->sys_us / 1000000, usage->sys_us % 1000000, usage->max_rss_kb);
+  else
+    buffer_append(csv, ",,,", 3);
+  if (sink->config->num_tests > 1) {
+    buffer_append(csv, COMMA, 1);
+    for (int t = 0; usage->measured && t < sink->config->num_tests; t++)
+      buffer_printf(csv, "%s%s", t ? TEST_SEP : "", reason_arr[student->verdicts[t]]);
+  }
+  buffer_append(csv, NEW_LINE, 1);
+}
+
+/**
+ * Adds a student's JSON line, with the timings and how the verdict was reached.
+ */
+void sink_json(Sink *sink, const Student *student) {
+  const Usage *usage = &student->usage;
+  Buffer *json = &sink->json;
+  buffer_append(json, "{\"name\":", 8);
+  buffer_json(json, student->folder_name);
+  buffer_printf(json, ",\"grade\":%d,\"reason\":\"%s\",\"source\":", student->grade, reason_arr[student->reason]);
+  if (!student->file_path)
+    buffer_append(json, "null", 4);
+  else
+    buffer_json(json, student->file_path);
+  buffer_append(json, ",\"tests\":[", 10);
+  for (int t = 0; usage->measured && t < sink->config->num_tests; t++)
+    buffer_printf(json, "%s{\"reason\":\"%s\",\"weight\":%g}", t ? COMMA : "", reason_arr[student->verdicts[t]],
+                  sink->config->tests[t].weight);
+  buffer_printf(json, "],\"compile_cached\":%s,\"reused\":%s,\"wall_ms\":%ld", student->cached ? "true" : "false",
+                student->reused ? "true" : "false", student->elapsed_ms);
+  buffer_printf(json, ",\"compile_ms\":%ld,\"compile_rss_kb\":%ld", student->compile_ms, student->compile_rss_kb);
+  if (usage->measured)
+    buffer_printf(json, ",\"user_s\":%ld.%06ld,\"sys_s\":%ld.%06ld,\"max_rss_kb\":%ld}" NEW_LINE,
+                  usage->user_us / 1000000, usage->user_us % 1000000, usage->sys_us / 1000000,
+                  usage->sys_us % 1000000, usage->max_rss_kb);
+  else
+    buffer_append(json, "}" NEW_LINE, 2);
+}
+
+/**
+ * Marks a student as finished and writes every row that is ready.
+ * @param   sink    Sink to write to.
+ * @param   i       Index of the finished student.
+ */
+void sink_done(Sink *sink, int i) {
+  long long now, start;
+  pthread_mutex_lock(&sink->lock);
+  start = now_us();
+  sink->done[i] = true;
+  for (; sink->next < sink->num_of_students && sink->done[sink->next]; sink->next++) {
+    sink_csv(sink, &sink->students[sink->next]);
+    if (sink->json.fd != ERROR)
+      sink_json(sink, &sink->students[sink->next]);
+  }
+  now = now_ms();
+  if (sink->csv.len + sink->json.len >= SINK_FLUSH_SIZE || now - sink->flushed_ms >= SINK_FLUSH_MS) {
+    buffer_flush(&sink->csv);
+    buffer_flush(&sink->json);
+    sink->flushed_ms = now;
+  }
+  sink->write_us += now_us() - start;
+  pthread_mutex_unlock(&sink->lock);
+}
+
+/**
+ * Writes what is left and closes the results files.
+ * @param   sink    Sink to close.
+ */
+void sink_close(Sink *sink) {
+  long long start = now_us();
+  buffer_flush(&sink->csv);
+  buffer_flush(&sink->json);
+  if (close(sink->csv.fd) == ERROR || (sink->json.fd != ERROR && close(sink->json.fd) == ERROR))
+    error();
+  sink->write_us += now_us() - start;
+  free(sink->csv.data);
+  free(sink->json.data);
+  free(sink->done);
+  pthread_mutex_destroy(&sink->lock);
+}
+
+/**
+ * Builds the path of a file in the student's scratch directory.
+ * @param   path      Buffer of MAX_LENGTH chars.
+ * @param   student   Student whose directory it is.
+ * @param   file      File name.
  */
-void save_CSV(Student *students, int num_of_students) {
-  int CSV = open(DOT_RESULT_FILE, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-  if (CSV == ERROR)
-    error();
-  for (int i = 0; i < num_of_students; ++i) {
-    char CSV_arr[CSV_WRITE_SIZE] = {};
-    strcpy(CSV_arr, students[i].folder_name);
-    strcat(CSV_arr, COMMA);
-    strcat(CSV_arr, grade_arr[students[i].reason]);
-    strcat(CSV_arr, COMMA);
-    strcat(CSV_arr, reason_arr[students[i].reason]);
-    strcat(CSV_arr, NEW_LINE);
-    if (write(CSV, CSV_arr, CSV_WRITE_SIZE) == ERROR)
+void scratch_path(char *path, const Student *student, const char *file) {
+  if (snprintf(path, MAX_LENGTH, "%s/%s", student->scratch, file) >= MAX_LENGTH)
+    error();
+}
+
+/**
+ * Compares the program's output with the expected output while reading it from a pipe, so it
+ * never touches the disk. Stops reading as soon as the output can't be similar anymore.
+ * @param   fd        Read end of the program's stdout.
+ * @param   test      Test with the loaded expected output.
+ * @param   deadline  now_ms() by which the output has to end.
+ * @return  Reason of student's grade, TIMEOUT if the output didn't end in time.
+ */
+reason compare(int fd, const Test *test, long long deadline) {
+  char buffer[PIPE_READ_SIZE];
+  struct pollfd pfd = {fd, POLLIN, 0};
+  comp_stream *stream = comp_stream_open(test->reference);
+  reason res = TBD;
+  ssize_t num_bytes;
+  while (res == TBD) {
+    long long left = deadline - now_ms();
+    int ready = left > 0 ? poll(&pfd, 1, (int) left) : 0;
+    if (ready == ERROR && errno == EINTR)
+      continue;
+    if (ready == ERROR)
       error();
+    if (ready == 0) {
+      res = TIMEOUT;
+      break;
+    }
+    num_bytes = read(fd, buffer, sizeof(buffer));
+    if (num_bytes == ERROR && errno == EINTR)
+      continue;
+    if (num_bytes == ERROR)
+      error();
+    if (num_bytes == 0)
+      break;
+    if (comp_stream_feed(stream, buffer, (size_t) num_bytes))
+      res = BAD_OUTPUT;
+  }
+  switch (comp_stream_close(stream)) {
+  case IDENTICAL: return res == TBD ? GREAT_JOB : res;
+  case SIMILAR: return res == TBD ? SIMILAR_OUTPUT : res;
+  default: return res == TBD ? BAD_OUTPUT : res;
   }
-  if (close(CSV) == ERROR)
+}
+
+/**
+ * Monotonic milliseconds, for the polling wait.
+ */
+long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Monotonic microseconds, for the timings.
+ */
+long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * CPU microseconds of the calling thread, for the timings.
+ */
+long long cpu_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Sends a message on a runner socket.
+ * @param   sock      Socket to send on.
+ * @param   data      Message.
+ * @param   len       Length of the message.
+ * @param   fds       Descriptors passed with the message.
+ * @param   num_fds   Number of descriptors, up to RUN_FDS.
+ * @return  True if sent, false if the other side closed its socket.
+ */
+bool send_message(int sock, const void *data, size_t len, const int *fds, int num_fds) {
+  union {
+    char buf[CMSG_SPACE(RUN_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {(void *) data, len};
+  struct msghdr msg = {NULL, 0, &iov, 1, NULL, 0, 0};
+  ssize_t sent;
+  if (num_fds > 0) {
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+  }
+  while ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) == ERROR && errno == EINTR);
+  if (sent == ERROR && errno != EPIPE && errno != ECONNRESET)
     error();
+  return sent == (ssize_t) len ? true : false;
+}
+
+/**
+ * Receives a message from a runner socket, with the descriptors passed with it (close on exec).
+ * @param   sock      Socket to receive from.
+ * @param   data      Set to the message.
+ * @param   len       Size of the message.
+ * @param   fds       Set to the descriptors, room for RUN_FDS.
+ * @param   num_fds   Set to the number of descriptors.
+ * @return  Length of the message, 0 if the other side closed its socket.
+ */
+ssize_t recv_message(int sock, void *data, size_t len, int *fds, int *num_fds) {
+  union {
+    char buf[CMSG_SPACE(RUN_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = {data, len};
+  struct msghdr msg = {NULL, 0, &iov, 1, control.buf, sizeof(control.buf), 0};
+  struct cmsghdr *cmsg;
+  ssize_t got;
+  while ((got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == ERROR && errno == EINTR);
+  if (got == ERROR && errno == ECONNRESET)
+    return 0;
+  if (got == ERROR)
+    error();
+  *num_fds = 0;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      *num_fds = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      memcpy(fds, CMSG_DATA(cmsg), *num_fds * sizeof(int));
+    }
+  return got;
 }
 
 /**
- * Compares two files using the comp.out file, to check if output is good.
- * @param   config  Config struct with correct output.
- * @return  Reason of student's grade.
+ * Starts a program for a worker with vfork, the child only sets itself up and execs. The limits
+ * are built before, so the child, which shares the runner's memory, writes nothing.
+ * @param   request   Scratch directory and limits of the run.
+ * @param   fds       The program's stdin and stdout.
+ * @return  Pid of the program, leader of its own process group.
  */
-reason compare(Config config) {
-  char *args[] = {DOT_COMP_FILE, config.output_file, DOT_OUTPUT_FILE, NULL};
-  int success;
-  pid_t pid = fork();
+pid_t runner_spawn(const RunRequest *request, const int *fds) {
+  char *args[] = {DOT_OUT_FILE, NULL};
+  struct rlimit limits[NUM_LIMITS];
+  int i;
+  for (i = 0; i < NUM_LIMITS; i++)
+    limits[i].rlim_cur = limits[i].rlim_max = (rlim_t) request->limits[i] * limit_units[i];
+  pid_t pid = vfork();
   if (pid == 0) {
-    success = execvp(args[0], args);
-    if (success == ERROR)
+    setpgid(0, 0);
+    for (i = 0; i < NUM_LIMITS; i++)
+      if (request->limits[i] > 0 && setrlimit(limit_resources[i], &limits[i]) == ERROR)
+        _exit(SPAWN_FAILED);
+    if (chdir(request->scratch) == ERROR || dup2(fds[0], STDIN_FILENO) == ERROR
+        || dup2(fds[1], STDOUT_FILENO) == ERROR)
+      _exit(SPAWN_FAILED);
+    execv(args[0], args);
+    _exit(SPAWN_FAILED);
+  }
+  if (pid == ERROR)
+    error();
+  return pid;
+}
+
+/**
+ * Kills a worker's program with whatever it left running in its group, reaps it and replies to
+ * the worker, unless the worker is gone.
+ * @param   running   The program.
+ * @param   sock      Socket of the worker, ERROR if it closed.
+ * @param   timed_out True if the program is killed at its deadline.
+ */
+void runner_reap(Running *running, int sock, bool timed_out) {
+  RunReply reply = {.timed_out = timed_out};
+  kill(-running->pid, SIGKILL);
+  if (wait4(running->pid, &reply.status, 0, &reply.usage) == ERROR)
+    error();
+  if (running->pidfd != ERROR)
+    close(running->pidfd);
+  running->pid = 0;
+  if (sock != ERROR)
+    send_message(sock, &reply, sizeof(reply), NULL, 0);
+}
+
+/**
+ * Runner process, forked before the grader grows. Serves a socket per run worker: starts the
+ * programs the workers ask for, kills them at their deadline or when the worker asks, and replies
+ * once they are reaped. Waits on pidfds when the kernel has them, otherwise checks the programs
+ * every POLL_MAX_NS. Returns when every worker closed its socket.
+ * @param   sockets   Runner ends of the sockets, one per worker.
+ * @param   num       Number of workers.
+ */
+void runner(int *sockets, int num) {
+  Running *running = calloc((size_t) num, sizeof(Running));
+  struct pollfd *pfds = calloc(2 * (size_t) num, sizeof(struct pollfd));
+  int *polled = calloc((size_t) num, sizeof(int));
+  int open_sockets = num, fds[RUN_FDS], num_fds, num_pfds, i;
+  RunRequest request;
+  siginfo_t info;
+  if (!running || !pfds || !polled)
+    error();
+  while (open_sockets > 0) {
+    long long now = now_ms(), wait = -1, left;
+    for (i = 0, num_pfds = 0; i < num; i++) {
+      polled[i] = ERROR;
+      if (sockets[i] != ERROR) {
+        polled[i] = num_pfds;
+        pfds[num_pfds++] = (struct pollfd) {sockets[i], POLLIN, 0};
+      }
+      if (running[i].pid == 0)
+        continue;
+      left = running[i].deadline > now ? running[i].deadline - now : 0;
+      if (running[i].pidfd != ERROR)
+        pfds[num_pfds++] = (struct pollfd) {running[i].pidfd, POLLIN, 0};
+      else if (left > POLL_MAX_NS / 1000000)
+        left = POLL_MAX_NS / 1000000;
+      wait = wait == -1 || left < wait ? left : wait;
+    }
+    if (poll(pfds, (nfds_t) num_pfds, (int) wait) == ERROR && errno != EINTR)
       error();
-  } else {
-    int value;
-    waitpid(pid, &value, 0);
-    if (WIFEXITED(value)) {
-      switch (WEXITSTATUS(value)) {
-      case 1: return BAD_OUTPUT;
-      case 2: return SIMILAR_OUTPUT;
-      case 3: return GREAT_JOB;
-      default: return TBD;
+    now = now_ms();
+    for (i = 0; i < num; i++) {
+      if (polled[i] != ERROR && pfds[polled[i]].revents) {
+        if (recv_message(sockets[i], &request, sizeof(request), fds, &num_fds) == 0) {
+          close(sockets[i]);
+          sockets[i] = ERROR;
+          open_sockets--;
+          if (running[i].pid != 0)
+            runner_reap(&running[i], ERROR, false);
+        } else if (num_fds == RUN_FDS) {
+          running[i].pid = runner_spawn(&request, fds);
+          running[i].pidfd = (int) syscall(SYS_pidfd_open, running[i].pid, 0);
+          running[i].deadline = now + request.timeout_ms;
+          close(fds[0]);
+          close(fds[1]);
+        } else if (running[i].pid != 0) {
+          // A request without descriptors kills the program, its output was already graded.
+          runner_reap(&running[i], sockets[i], false);
+        }
       }
+      if (running[i].pid == 0)
+        continue;
+      // Checks without reaping, so the group can still be killed by the leader's pid.
+      info.si_pid = 0;
+      if (waitid(P_PID, (id_t) running[i].pid, &info, WEXITED | WNOHANG | WNOWAIT) == ERROR)
+        error();
+      if (info.si_pid != 0 || now >= running[i].deadline)
+        runner_reap(&running[i], sockets[i], info.si_pid == 0 ? true : false);
     }
   }
-  return TBD;
+  free(running);
+  free(pfds);
+  free(polled);
 }
 
 /**
- * Runs the compiled file.
- * @param   config  Config struct with correct input/output.
- * @return  Returns reason of student's grade.
+ * Forks the runner with a socket per run worker. Called before the references are loaded and the
+ * threads start, so the runner is a small single threaded copy of the grader.
+ * @param   config  Config struct, gets the grader ends of the sockets.
  */
-reason run(Config config) {
-  char *args[] = {DOT_OUT_FILE, NULL};
-  int success;
+void start_runner(Config *config) {
+  int *ends = malloc(sizeof(int) * config->workers), pair[2], i;
+  if (!ends || !(config->runners = malloc(sizeof(int) * config->workers)))
+    error();
+  for (i = 0; i < config->workers; i++) {
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) == ERROR)
+      error();
+    config->runners[i] = pair[0];
+    ends[i] = pair[1];
+  }
+  config->runner_pid = fork();
+  if (config->runner_pid == ERROR)
+    error();
+  if (config->runner_pid == 0) {
+    for (i = 0; i < config->workers; i++)
+      close(config->runners[i]);
+    if (config->jobserver != ERROR)
+      close(config->jobserver);
+    runner(ends, config->workers);
+    _exit(0);
+  }
+  for (i = 0; i < config->workers; i++)
+    close(ends[i]);
+  free(ends);
+}
+
+/**
+ * Closes the runner's sockets and waits for it to exit.
+ * @param   config  Config struct.
+ */
+void stop_runner(Config *config) {
+  for (int i = 0; i < config->workers; i++)
+    close(config->runners[i]);
+  free(config->runners);
+  if (waitpid(config->runner_pid, NULL, 0) == ERROR)
+    error();
+}
+
+/**
+ * Parses resource limits, a comma separated list of name=value.
+ * @param   spec    Limits to parse, changed by parsing.
+ * @param   config  Config struct to set the limits in.
+ * @return  True if parsed, false if a limit is unknown.
+ */
+bool parse_limits(char *spec, Config *config) {
+  char *token, *save = NULL, *value;
+  int i;
+  for (token = strtok_r(spec, LIMITS_SEP, &save); token; token = strtok_r(NULL, LIMITS_SEP, &save)) {
+    if (!(value = strchr(token, '=')))
+      return false;
+    *value++ = '\0';
+    for (i = 0; i < NUM_LIMITS && strcmp(token, limit_names[i]) != 0; i++);
+    if (i == NUM_LIMITS)
+      return false;
+    config->limits[i] = atol(value);
+  }
+  return true;
+}
+
+/**
+ * Runs the compiled file on a test inside the student's scratch directory, under the resource
+ * limits, and compares its output. The runner starts the program and reports how it ended.
+ * @param   student   Student to run, its usage is added up.
+ * @param   config    Config struct.
+ * @param   test      Test with correct input/output.
+ * @param   runner    This worker's socket to the runner.
+ * @return  Returns reason of student's grade in the test.
+ */
+reason run(Student *student, const Config *config, const Test *test, int runner) {
+  RunRequest request = {.timeout_ms = config->timeout_ms};
+  RunReply reply;
+  int fds[2], files[RUN_FDS], num_fds;
+  long long user_us, sys_us;
   reason res;
-  int pid = fork();
+  memcpy(request.limits, config->limits, sizeof(request.limits));
+  strcpy(request.scratch, student->scratch);
+  if (pipe2(fds, O_CLOEXEC) == ERROR)
+    error();
+  files[0] = open(test->input_file, O_RDONLY | O_CLOEXEC);
+  files[1] = fds[1];
+  if (files[0] == ERROR)
+    error();
+  long long deadline = now_ms() + config->timeout_ms, sent_us = now_us(), start_cpu = cpu_us();
+  if (send_message(runner, &request, sizeof(request), files, RUN_FDS) == false)
+    error();
+  close(files[0]);
+  close(fds[1]);
+  res = compare(fds[0], test, deadline);
+  student->compare_us += cpu_us() - start_cpu;
+  close(fds[0]);
+  // Wrong or endless output is final, the program is killed right away.
+  if ((res == BAD_OUTPUT || res == TIMEOUT) && send_message(runner, &request, sizeof(request), NULL, 0) == false)
+    error();
+  if (recv_message(runner, &reply, sizeof(reply), files, &num_fds) != sizeof(reply))
+    error();
+  student->run_us += now_us() - sent_us;
+  student->usage.measured = true;
+  user_us = reply.usage.ru_utime.tv_sec * 1000000LL + reply.usage.ru_utime.tv_usec;
+  sys_us = reply.usage.ru_stime.tv_sec * 1000000LL + reply.usage.ru_stime.tv_usec;
+  student->usage.user_us += user_us;
+  student->usage.sys_us += sys_us;
+  if (reply.usage.ru_maxrss > student->usage.max_rss_kb)
+    student->usage.max_rss_kb = reply.usage.ru_maxrss;
+  // Output cut short because the runner killed the program at the deadline is a timeout too.
+  if (reply.timed_out)
+    return TIMEOUT;
+  // The cpu limit kills with SIGXCPU, or SIGKILL at the hard limit, cutting the output short.
+  // Other kills (the runner after bad output, the OOM killer, someone else) keep the verdict of the
+  // output.
+  if (WIFSIGNALED(reply.status) && (WTERMSIG(reply.status) == SIGXCPU
+      || (WTERMSIG(reply.status) == SIGKILL && config->limits[LIMIT_CPU] > 0
+          && user_us + sys_us + CPU_SLACK_US >= config->limits[LIMIT_CPU] * 1000000LL)))
+    return TIMEOUT;
+  return res;
+}
+
+/**
+ * FNV-1a hash.
+ * @param   hash  Hash so far, FNV_OFFSET to start.
+ * @param   data  Bytes to add.
+ * @param   len   Number of bytes.
+ * @return  The new hash.
+ */
+unsigned long long hash_bytes(unsigned long long hash, const char *data, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char) data[i]) * FNV_PRIME;
+  return hash;
+}
+
+/**
+ * Adds a file's content to a hash.
+ * @param   path  File to hash.
+ * @param   hash  Hash to update.
+ * @return  True if the file was read, false otherwise.
+ */
+bool hash_file(const char *path, unsigned long long *hash) {
+  char buffer[COPY_SIZE];
+  ssize_t num_bytes;
+  int fd = open(path, O_RDONLY);
+  if (fd == ERROR)
+    return false;
+  while ((num_bytes = read(fd, buffer, sizeof(buffer))) > 0)
+    *hash = hash_bytes(*hash, buffer, (size_t) num_bytes);
+  close(fd);
+  return num_bytes == 0 ? true : false;
+}
+
+/**
+ * Reads every .c and .h under a student's folder into its sources, in name order, so the cache
+ * key covers the headers the program includes. Each file is its path, its size and its bytes.
+ * @param   student   Student to read for.
+ * @param   dir       Directory to read.
+ * @param   prefix    Path of dir in the student's folder, "" for the folder itself.
+ * @return  True if every file was read, false otherwise.
+ */
+bool read_sources(Student *student, const char *dir, const char *prefix) {
+  char path[PATH_MAX], name[PATH_MAX], header[PATH_MAX + 32];
+  struct dirent **entries;
+  struct stat info;
+  size_t len;
+  bool ok = true;
+  int num, i, fd;
+  if ((num = scandir(dir, &entries, NULL, alphasort)) == ERROR)
+    return false;
+  for (i = 0; i < num; i++) {
+    len = strlen(entries[i]->d_name);
+    if (ok && entries[i]->d_name[0] != '.'
+        && (snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name) >= (int) sizeof(path)
+            || snprintf(name, sizeof(name), "%s%s", prefix, entries[i]->d_name) >= (int) sizeof(name)))
+      ok = false; // Sources that can't be read by path aren't all in the key.
+    if (ok && entries[i]->d_name[0] != '.' && stat(path, &info) == 0) {
+      if (S_ISDIR(info.st_mode)) {
+        strcat(name, "/");
+        ok = read_sources(student, path, name);
+      } else if (S_ISREG(info.st_mode) && len > 2 && entries[i]->d_name[len - 2] == '.'
+          && (entries[i]->d_name[len - 1] == 'c' || entries[i]->d_name[len - 1] == 'h')) {
+        len = (size_t) snprintf(header, sizeof(header), "%s%c%lld%c", name, '\0', (long long) info.st_size, '\0');
+        if (!(student->sources = realloc(student->sources, student->sources_len + len + (size_t) info.st_size)))
+          error();
+        memcpy(student->sources + student->sources_len, header, len);
+        student->sources_len += len;
+        if ((fd = open(path, O_RDONLY)) == ERROR
+            || read(fd, student->sources + student->sources_len, (size_t) info.st_size) != info.st_size)
+          ok = false;
+        student->sources_len += (size_t) info.st_size;
+        if (fd != ERROR)
+          close(fd);
+      }
+    }
+    free(entries[i]);
+  }
+  free(entries);
+  return ok;
+}
+
+/**
+ * Frees a student's sources once the cache is done with them.
+ * @param   student   Student to free.
+ */
+void free_sources(Student *student) {
+  free(student->sources);
+  student->sources = NULL;
+  student->sources_len = 0;
+}
+
+/**
+ * Hashes what the compiler is: the output of gcc --version and the flags.
+ * @return  Hash to start every cache key with.
+ */
+unsigned long long compiler_hash() {
+  char *args[] = {COMPILE_GCC, "--version", NULL};
+  char buffer[COPY_SIZE];
+  unsigned long long hash = hash_bytes(FNV_OFFSET, COMPILE_GCC, sizeof(COMPILE_GCC));
+  ssize_t num_bytes;
+  int fds[2];
+  pid_t pid;
+  if (pipe(fds) == ERROR)
+    error();
+  pid = fork();
   if (pid == 0) {
-    int out = open(DOT_OUTPUT_FILE, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-    if (out == ERROR)
-      error();
-    int in = open(config.input_file, O_RDONLY);
-    if (in == ERROR)
-      error();
-    success = dup2(in, STDIN_FILENO);
-    if (success == ERROR)
-      error();
-    success = dup2(out, STDOUT_FILENO);
-    if (success == ERROR)
-      error();
-    success = execvp(args[0], args);
-    if (success == ERROR)
-      error();
-    success = close(in);
-    if (success == ERROR)
-      error();
-    success = close(out);
-    if (success == ERROR)
-      error();
+    if (dup2(fds[1], STDOUT_FILENO) == ERROR)
+      child_error();
+    close(fds[0]);
+    execvp(args[0], args);
+    child_error();
+  } else if (pid == ERROR) {
+    error();
+  }
+  close(fds[1]);
+  while ((num_bytes = read(fds[0], buffer, sizeof(buffer))) > 0)
+    hash = hash_bytes(hash, buffer, (size_t) num_bytes);
+  close(fds[0]);
+  waitpid(pid, NULL, 0);
+  for (int i = 0; compile_flags[i]; i++)
+    hash = hash_bytes(hash, compile_flags[i], strlen(compile_flags[i]) + 1);
+  return hash;
+}
+
+/**
+ * Writes a compile cache entry through a temporary name, so readers never see it half written:
+ * the student's sources, then the binary if there is one.
+ * @param   student   Student whose sources start the entry.
+ * @param   from      Binary to store, NULL for a failure marker.
+ * @param   to        Entry to write, executable.
+ * @return  True if written, false otherwise.
+ */
+bool store_entry(const Student *student, const char *from, const char *to) {
+  char buffer[COPY_SIZE], tmp[PATH_MAX];
+  ssize_t num_bytes = 0;
+  int in = ERROR, out;
+  snprintf(tmp, sizeof(tmp), "%s.%d.%lu", to, getpid(), (unsigned long) pthread_self());
+  if (from && (in = open(from, O_RDONLY)) == ERROR)
+    return false;
+  if ((out = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0755)) == ERROR) {
+    num_bytes = ERROR;
   } else {
-    sleep(5);
-    pid_t ret = waitpid(pid, NULL, WNOHANG);
-    if (ret == 0) { // More than 5 seconds.
-      return TIMEOUT;
-    } else {
-      return compare(config);
+    if (write(out, student->sources, student->sources_len) != (ssize_t) student->sources_len)
+      num_bytes = ERROR;
+    while (in != ERROR && num_bytes != ERROR && (num_bytes = read(in, buffer, sizeof(buffer))) > 0)
+      if (write(out, buffer, (size_t) num_bytes) != num_bytes)
+        num_bytes = ERROR;
+    close(out);
+  }
+  if (in != ERROR)
+    close(in);
+  if (num_bytes == 0 && rename(tmp, to) == 0)
+    return true;
+  unlink(tmp);
+  return false;
+}
+
+/**
+ * Reads a compile cache entry if it was made from the same sources as the student's, so a hash
+ * collision is a miss. The binary is copied through a temporary name.
+ * @param   student   Student whose sources the entry must start with.
+ * @param   from      Entry to read.
+ * @param   to        Where the binary goes, executable, NULL for a failure marker.
+ * @return  True if the sources match (and the binary was copied), false otherwise.
+ */
+bool load_entry(const Student *student, const char *from, const char *to) {
+  char buffer[COPY_SIZE], tmp[PATH_MAX];
+  size_t checked = 0, want;
+  ssize_t num_bytes = 0;
+  int in, out;
+  if ((in = open(from, O_RDONLY)) == ERROR)
+    return false;
+  while (checked < student->sources_len) {
+    want = student->sources_len - checked < sizeof(buffer) ? student->sources_len - checked : sizeof(buffer);
+    if ((num_bytes = read(in, buffer, want)) <= 0 || memcmp(buffer, student->sources + checked, (size_t) num_bytes)) {
+      close(in);
+      return false;
     }
+    checked += (size_t) num_bytes;
+  }
+  if (!to) {
+    num_bytes = read(in, buffer, 1); // A failure marker holds nothing else.
+    close(in);
+    return num_bytes == 0;
   }
+  snprintf(tmp, sizeof(tmp), "%s.%d.%lu", to, getpid(), (unsigned long) pthread_self());
+  if ((out = open(tmp, O_CREAT | O_WRONLY | O_TRUNC, 0755)) != ERROR) {
+    while ((num_bytes = read(in, buffer, sizeof(buffer))) > 0)
+      if (write(out, buffer, (size_t) num_bytes) != num_bytes) {
+        num_bytes = ERROR;
+        break;
+      }
+    close(out);
+  } else {
+    num_bytes = ERROR;
+  }
+  close(in);
+  if (num_bytes == 0 && rename(tmp, to) == 0)
+    return true;
+  unlink(tmp);
+  return false;
 }
 
 /**
- * Compiles the files using GCC and forking.
+ * Looks a student up in the compile cache, which is keyed by the hash of the compiler, flags and
+ * sources and holds the sources and a binary or a failure marker.
+ * @param   student   Current student to compile, cached is set on a hit.
+ * @param   config    Config struct with the cache.
+ * @return  True on a hit: the binary is in the scratch directory, or the compile failed before.
+ */
+bool compile_cached(Student *student, const Config *config) {
+  char out[MAX_LENGTH], cached[MAX_LENGTH * 2];
+  if (!student->hashed)
+    return false;
+  scratch_path(out, student, OUT_FILE);
+  snprintf(cached, sizeof(cached), "%s/%016llx.%s", config->cache_dir, student->source_hash, CACHE_FAIL);
+  if (load_entry(student, cached, NULL))
+    student->cached = true;
+  snprintf(cached, sizeof(cached), "%s/%016llx.%s", config->cache_dir, student->source_hash, CACHE_OUT);
+  if (!student->cached && load_entry(student, cached, out)) // A copy, the program may write to itself.
+    student->cached = true;
+  if (student->cached)
+    free_sources(student);
+  return student->cached;
+}
+
+/**
+ * Starts compiling the files using GCC and forking, into the student's scratch directory.
  * @param   student   Current student to compile.
+ * @return  Pid of the compiler.
  */
-void compile(Student student) {
-  char *args[] = {COMPILE_GCC, "-o", OUT_FILE, student.file_path, NULL};
-  int success;
+pid_t compile_start(const Student *student) {
+  char out[MAX_LENGTH];
+  char *args[MAX_LENGTH] = {COMPILE_GCC, "-o", out};
+  int success, i, num = 3;
   pid_t pid;
+  scratch_path(out, student, OUT_FILE);
+  for (i = 0; compile_flags[i]; i++)
+    args[num++] = (char *) compile_flags[i];
+  args[num++] = (char *) student->file_path;
+  args[num] = NULL;
   pid = fork();
   if (pid == 0) {
     success = execvp(args[0], args);
     if (success == ERROR)
-      error();
+      child_error();
+  } else if (pid == ERROR) {
+    error();
+  }
+  return pid;
+}
+
+/**
+ * Stores what the compiler made in the compile cache.
+ * @param   student   Student that was compiled.
+ * @param   config    Config struct with the cache.
+ */
+void compile_store(Student *student, const Config *config) {
+  char out[MAX_LENGTH], cached[MAX_LENGTH * 2];
+  if (!student->hashed) {
+    free_sources(student);
+    return;
+  }
+  scratch_path(out, student, OUT_FILE);
+  if (check_for_out(student)) {
+    snprintf(cached, sizeof(cached), "%s/%016llx.%s", config->cache_dir, student->source_hash, CACHE_OUT);
+    store_entry(student, out, cached);
   } else {
-    waitpid(pid, NULL, 0);
+    snprintf(cached, sizeof(cached), "%s/%016llx.%s", config->cache_dir, student->source_hash, CACHE_FAIL);
+    store_entry(student, NULL, cached);
   }
+  free_sources(student);
 }
 
 /**
- * Grades the students.
- * @param students
- * @param num_of_students
- * @param config
+ * Opens the GNU make jobserver from MAKEFLAGS, when running under make -j. Each byte read from it
+ * is a token for one more compiler, and is written back when that compiler exits. The pipe is
+ * reopened through /proc so it can be non-blocking without changing make's own descriptor, and
+ * the descriptors make passed are closed so the runner and the programs don't inherit them.
+ * @return  Non-blocking descriptor of the jobserver, ERROR if there is none.
+ */
+int open_jobserver() {
+  const char *flags = getenv("MAKEFLAGS"), *auth;
+  char path[FD_PATH_SIZE + MAX_LENGTH];
+  int read_fd = ERROR, write_fd = ERROR, fd;
+  if (!flags)
+    return ERROR;
+  if (!(auth = strstr(flags, JOBSERVER_AUTH)) && !(auth = strstr(flags, JOBSERVER_FDS)))
+    return ERROR;
+  auth = strchr(auth, '=') + 1;
+  if (!strncmp(auth, JOBSERVER_FIFO, strlen(JOBSERVER_FIFO))) {
+    snprintf(path, sizeof(path), "%s", auth + strlen(JOBSERVER_FIFO));
+    path[strcspn(path, " ")] = '\0';
+  } else if (sscanf(auth, "%d,%d", &read_fd, &write_fd) == 2 && fcntl(read_fd, F_GETFD) != ERROR
+      && fcntl(write_fd, F_GETFD) != ERROR) {
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", read_fd);
+  } else {
+    return ERROR; // Make didn't pass the pipe to us, e.g. the rule isn't marked with +.
+  }
+  // Read and written through one descriptor, both ends of the same pipe or fifo.
+  fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (read_fd != ERROR) {
+    close(read_fd);
+    close(write_fd);
+  }
+  return fd;
+}
+
+/**
+ * Compares results by folder name, for sorting and searching.
+ */
+int compare_results(const void *a, const void *b) {
+  return strcmp(((const Result *) a)->folder_name, ((const Result *) b)->folder_name);
+}
+
+/**
+ * Loads the verdicts of the last run from the state file, if there is one, sorted by folder name.
+ * @param config    Config struct to load into.
+ */
+void load_state(Config *config) {
+  char *line = NULL, verdicts[MAX_TESTS + 2];
+  size_t size = 0;
+  ssize_t len;
+  int capacity = 0, reason_num, t, name_at;
+  FILE *file = fopen(config->state_file, "r");
+  Result result;
+  config->results = NULL;
+  config->num_results = 0;
+  if (!file)
+    return;
+  while ((len = getline(&line, &size, file)) > 0) {
+    if (line[len - 1] != '\n') // Cut short, the state file was being written.
+      continue;
+    line[len - 1] = '\0';
+    if (sscanf(line, STATE_SCAN, &result.source_hash, &result.test_hash, &result.grade, verdicts,
+               &result.usage.user_us, &result.usage.sys_us, &result.usage.max_rss_kb, &name_at) != 7
+        || line[name_at] != ' ' || !line[name_at + 1] || strlen(line + name_at + 1) >= sizeof(result.folder_name))
+      continue;
+    strcpy(result.folder_name, line + name_at + 1);
+    // The first digit is the reason of the student, then one digit per test.
+    for (t = 0; verdicts[t] >= '0' + NO_C_FILE && verdicts[t] < '0' + TBD; t++)
+      if (t > 0)
+        result.verdicts[t - 1] = (reason) (verdicts[t] - '0');
+    if (t == 0 || verdicts[t] != '\0')
+      continue;
+    reason_num = verdicts[0] - '0';
+    result.reason = (reason) reason_num;
+    result.usage.measured = result.usage.max_rss_kb > 0 ? true : false;
+    if (config->num_results == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      if (!(config->results = realloc(config->results, sizeof(Result) * capacity)))
+        error();
+    }
+    config->results[config->num_results++] = result;
+  }
+  free(line);
+  fclose(file);
+  qsort(config->results, (size_t) config->num_results, sizeof(Result), compare_results);
+}
+
+/**
+ * Finds the last verdict of a student, if nothing it depends on changed.
+ * @param config    Config struct with the loaded state.
+ * @param student   Student with its source hashed.
+ * @return  The verdict, NULL if the student has to be graded.
+ */
+const Result *find_result(const Config *config, const Student *student) {
+  const Result *result;
+  if (!student->hashed || !config->num_results)
+    return NULL;
+  result = bsearch(student->folder_name, config->results, (size_t) config->num_results, sizeof(Result),
+                   compare_results);
+  if (result && result->source_hash == student->source_hash && result->test_hash == config->test_hash)
+    return result;
+  return NULL;
+}
+
+/**
+ * Saves the verdicts of this run, replacing the state file at once.
+ * @param students          List of all students.
+ * @param num_of_students   Number of students in the list.
+ * @param config            Config struct.
+ */
+void save_state(const Student *students, int num_of_students, const Config *config) {
+  char tmp[MAX_LENGTH * 2], verdicts[MAX_TESTS + 2];
+  FILE *file;
+  snprintf(tmp, sizeof(tmp), "%s.%d", config->state_file, getpid());
+  if (!(file = fopen(tmp, "w")))
+    error();
+  for (int i = 0; i < num_of_students; i++) {
+    if (!students[i].hashed || students[i].reason == TBD)
+      continue;
+    verdicts[0] = (char) ('0' + students[i].reason);
+    for (int t = 0; t < config->num_tests; t++)
+      verdicts[t + 1] = (char) ('0' + students[i].verdicts[t]);
+    verdicts[config->num_tests + 1] = '\0';
+    fprintf(file, STATE_FORMAT, students[i].source_hash, config->test_hash, students[i].grade, verdicts,
+            students[i].usage.user_us, students[i].usage.sys_us, students[i].usage.max_rss_kb,
+            students[i].folder_name);
+  }
+  if (fclose(file) == EOF || rename(tmp, config->state_file) == ERROR)
+    error();
+}
+
+/**
+ * Makes the scratch directory of a student to compile. A student whose source and tests didn't
+ * change since the last run keeps its verdict instead.
+ * @param student   Student to compile.
+ * @param config    Config struct.
+ * @return  True if the student has to be compiled, false if it is graded already.
+ */
+bool prepare_student(Student *student, const Config *config) {
+  const Result *result;
+  if (student->reason == NO_C_FILE || student->reason == PATH_TOO_LONG) // Compile only students with C files
+    return false;
+  student->started_ms = now_ms();
+  student->hashed = read_sources(student, student->folder_path, "");
+  student->source_hash = hash_bytes(config->compiler_hash, student->sources, student->sources_len);
+  if ((result = find_result(config, student))) {
+    free_sources(student);
+    student->reason = result->reason;
+    student->grade = result->grade;
+    student->usage = result->usage;
+    memcpy(student->verdicts, result->verdicts, sizeof(result->verdicts));
+    student->reused = true;
+    return false;
+  }
+  if (mkdir(student->scratch, 0700) == ERROR)
+    error();
+  return true;
+}
+
+/**
+ * Checks what the compiler made for a student.
+ * @param student   Student that was compiled.
+ * @return  True if the student has a program to run, false if it is graded already.
+ */
+bool finish_build(Student *student) {
+  if (check_for_out(student) == true)
+    return true;
+  student->reason = COMPILATION_ERROR;
+  student->elapsed_ms = (long) (now_ms() - student->started_ms);
+  if (rmdir(student->scratch) == ERROR)
+    error();
+  return false;
+}
+
+/**
+ * Runs all the tests of a compiled student, then removes its scratch directory. The grade is the
+ * weighted average of the tests, the reason is the one of the worst test.
+ * @param student   Student to run.
+ * @param config    Config struct.
+ * @param runner    Socket of the worker to the runner.
+ */
+void run_student(Student *student, const Config *config, int runner) {
+  char path[MAX_LENGTH];
+  double total = 0, weights = 0;
+  int worst = 0, grade;
+  for (int t = 0; t < config->num_tests; t++) {
+    student->verdicts[t] = run(student, config, &config->tests[t], runner);
+    grade = atoi(grade_arr[student->verdicts[t]]);
+    total += grade * config->tests[t].weight;
+    weights += config->tests[t].weight;
+    if (grade < atoi(grade_arr[student->verdicts[worst]]))
+      worst = t;
+  }
+  student->reason = student->verdicts[worst];
+  student->grade = weights > 0 ? (int) (total / weights + 0.5) : 0;
+  student->elapsed_ms = (long) (now_ms() - student->started_ms);
+  scratch_path(path, student, OUT_FILE);
+  if (unlink(path) == ERROR)
+    error();
+  if (rmdir(student->scratch) == ERROR)
+    error();
+}
+
+/**
+ * Hands a student from the compile farm to the run workers, or to the sink if it is graded.
+ * @param grader    Grader shared by all workers.
+ * @param i         Index of the student.
+ * @param compiled  True if the student has a program to run.
+ */
+void publish(Grader *grader, int i, bool compiled) {
+  pthread_mutex_lock(&grader->lock);
+  if (compiled)
+    grader->ready[grader->tail++] = i;
+  grader->compiled++;
+  pthread_cond_broadcast(&grader->cond);
+  pthread_mutex_unlock(&grader->lock);
+  if (!compiled)
+    sink_done(grader->sink, i);
+}
+
+/**
+ * Reaps a finished compiler, gives back its token and publishes the student.
+ * @param grader    Grader shared by all workers.
+ * @param build     Compiler that exited.
+ * @param usage     Its resource usage.
  */
-void grade(Student *students, int num_of_students, Config config) {
-  int i = 0;
-  bool has_out;
-  while (i < num_of_students) {
-    if (students[i].reason != NO_C_FILE) { // Compile only students with C files
-      compile(students[i]);
-      has_out = check_for_out();
-      if (has_out == false) {
-        students[i].reason = COMPILATION_ERROR;
+void finish_compile(Grader *grader, const Build *build, const struct rusage *usage) {
+  Student *student = &grader->students[build->student];
+  char token = (char) build->token;
+  student->compile_ms = (long) (now_ms() - build->started_ms);
+  student->compile_rss_kb = usage->ru_maxrss;
+  if (build->token != ERROR)
+    while (write(grader->config->jobserver, &token, 1) == ERROR && errno == EINTR);
+  if (build->pidfd != ERROR)
+    close(build->pidfd);
+  compile_store(student, grader->config);
+  publish(grader, build->student, finish_build(student));
+}
+
+/**
+ * Compile farm. Starts compilers while there are free slots: the first one always, and every
+ * other one with a jobserver token when running under make, up to config.compilers. Then waits
+ * for any of them to exit (on their pidfds) or for a token, and reaps compilers as they finish.
+ * @param arg   Grader shared by all workers.
+ * @return  NULL.
+ */
+void *compile_farm(void *arg) {
+  Grader *grader = (Grader *) arg;
+  const Config *config = grader->config;
+  Build *builds = calloc((size_t) config->compilers, sizeof(Build));
+  struct pollfd *fds = calloc((size_t) config->compilers + 1, sizeof(struct pollfd));
+  struct rusage usage;
+  int next = 0, running = 0, num_fds, token, status, i;
+  bool polling = false, waiting_token, prepared = false;
+  unsigned char byte;
+  if (!builds || !fds)
+    error();
+  while (next < grader->num_of_students || running > 0) {
+    waiting_token = false;
+    while (next < grader->num_of_students && running < config->compilers) {
+      Student *student = &grader->students[next];
+      // Students that need no compiler don't wait for a token.
+      if (!prepared && (!prepare_student(student, config) || compile_cached(student, config))) {
+        publish(grader, next, student->cached ? finish_build(student) : false);
+        next++;
+        continue;
+      }
+      prepared = true;
+      token = ERROR;
+      if (running > 0 && config->jobserver != ERROR) {
+        if (read(config->jobserver, &byte, 1) != 1) {
+          waiting_token = true;
+          break;
+        }
+        token = byte;
+      }
+      prepared = false;
+      Build *build = &builds[running++];
+      build->student = next++;
+      build->token = token;
+      build->started_ms = now_ms();
+      build->pid = compile_start(student);
+      build->pidfd = (int) syscall(SYS_pidfd_open, build->pid, 0);
+      polling = build->pidfd == ERROR ? true : polling;
+    }
+    if (running == 0)
+      continue;
+    for (i = 0, num_fds = 0; i < running; i++)
+      if (builds[i].pidfd != ERROR)
+        fds[num_fds++] = (struct pollfd) {builds[i].pidfd, POLLIN, 0};
+    if (waiting_token)
+      fds[num_fds++] = (struct pollfd) {config->jobserver, POLLIN, 0};
+    // Without pidfds the compilers are checked every POLL_MAX_NS.
+    if (poll(fds, (nfds_t) num_fds, polling ? POLL_MAX_NS / 1000000 : -1) == ERROR && errno != EINTR)
+      error();
+    for (i = 0; i < running;) {
+      if (wait4(builds[i].pid, &status, WNOHANG, &usage) != builds[i].pid) {
         i++;
         continue;
       }
-      students[i].reason = run(config);
-      if (unlink(OUT_FILE) == ERROR)
-        error();
+      finish_compile(grader, &builds[i], &usage);
+      builds[i] = builds[--running];
     }
-    i++;
   }
+  free(builds);
+  free(fds);
+  return NULL;
+}
+
+/**
+ * Run worker, takes compiled students from the queue until every student was compiled. Each
+ * worker has its own socket to the runner.
+ * @param arg   Grader shared by all workers.
+ * @return  NULL.
+ */
+void *run_worker(void *arg) {
+  Grader *grader = (Grader *) arg;
+  int i;
+  pthread_mutex_lock(&grader->lock);
+  int runner = grader->config->runners[grader->next_runner++];
+  pthread_mutex_unlock(&grader->lock);
+  for (;;) {
+    pthread_mutex_lock(&grader->lock);
+    while (grader->head == grader->tail && grader->compiled < grader->num_of_students)
+      pthread_cond_wait(&grader->cond, &grader->lock);
+    if (grader->head == grader->tail) {
+      pthread_mutex_unlock(&grader->lock);
+      return NULL;
+    }
+    i = grader->ready[grader->head++];
+    pthread_mutex_unlock(&grader->lock);
+    run_student(&grader->students[i], grader->config, runner);
+    sink_done(grader->sink, i);
+  }
+}
+
+/**
+ * Grades the students on a compile farm feeding config.workers run threads.
+ * @param students
+ * @param num_of_students
+ * @param config
+ * @param sink      Results sink, gets every student when it is graded.
+ */
+void grade(Student *students, int num_of_students, Config config, Sink *sink) {
+  Grader grader = {.students = students, .num_of_students = num_of_students, .config = &config};
+  int workers = config.workers < num_of_students ? config.workers : num_of_students, i;
+  pthread_t *threads;
+  if (num_of_students == 0)
+    return;
+  if (!(threads = malloc(sizeof(pthread_t) * (1 + workers))))
+    error();
+  if (!(grader.ready = malloc(sizeof(int) * num_of_students)))
+    error();
+  grader.sink = sink;
+  pthread_mutex_init(&grader.lock, NULL);
+  pthread_cond_init(&grader.cond, NULL);
+  for (i = 0; i < 1 + workers; i++)
+    if (pthread_create(&threads[i], NULL, i == 0 ? compile_farm : run_worker, &grader) != 0)
+      error();
+  for (i = 0; i < 1 + workers; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&grader.lock);
+  pthread_cond_destroy(&grader.cond);
+  free(grader.ready);
+  free(threads);
 }
 
 /**
@@ -215,159 +1545,405 @@ const char *get_filename_ext(const char *filename, const char sep) {
 }
 
 /**
- * Checks if .out file exists.
+ * Checks if .out file exists in the student's scratch directory.
+ * @param   student   Student that was compiled.
  * @return  True if exists, false otherwise.
  */
-bool check_for_out() {
-  struct dirent *entry;
-  char cwd[MAX_LENGTH];
-  bool ret = false;
-  DIR *dir;
-  if (!(dir = opendir(getcwd(cwd, MAX_LENGTH))))
-    error();
+bool check_for_out(const Student *student) {
+  char path[MAX_LENGTH];
+  scratch_path(path, student, OUT_FILE);
+  return access(path, F_OK) == 0 ? true : false;
+}
 
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry->d_type == DT_DIR) {
-      continue;
-    } else {
-      if (strcmp(entry->d_name, OUT_FILE) != 0) {
-        ret = false;
-        continue;
-      }
-      ret = true;
-    }
-  }
-  if (closedir(dir) == ERROR)
-    error();
-  return ret;
+/**
+ * Checks if a directory entry is a directory, asking the file system only when readdir can't tell.
+ * @param dir_fd    Directory holding the entry.
+ * @param entry     Entry to check.
+ * @return  True for a directory (not a link to one), false otherwise.
+ */
+bool is_directory(int dir_fd, const struct dirent *entry) {
+  struct stat st;
+  if (entry->d_type != DT_UNKNOWN)
+    return entry->d_type == DT_DIR ? true : false;
+  if (fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == ERROR)
+    return false;
+  return S_ISDIR(st.st_mode) ? true : false;
 }
 
 /**
- * Recursively check all subdirectories until a C file is found.
+ * Recursively check all subdirectories until a C file is found. Directories are opened relative
+ * to their parent, so no full path is resolved more than once. A student with no C file who has
+ * entries whose path is longer than PATH_MAX is PATH_TOO_LONG rather than NO_C_FILE.
  * @param student   Student being checked.
- * @param name      Path to current folder.
+ * @param fd        Open directory to check, closed when done.
+ * @param path      Path of the directory, PATH_MAX chars that are appended to while recursing.
+ * @param len       Length of path.
  */
-void check_subdirectories(Student *student, char *name) {
-  if (student->reason != TBD)
-    student->reason = NO_C_FILE;
-
+void check_subdirectories(Student *student, int fd, char *path, size_t len) {
   DIR *dir;
   struct dirent *entry;
+  size_t name_len;
+  int sub_fd;
 
-  if (!(dir = opendir(name)))
+  if (!(dir = fdopendir(fd))) {
+    close(fd);
     return;
+  }
 
   while ((entry = readdir(dir)) != NULL) {
-    if (entry->d_type == DT_DIR) {
-      char path[300];
-      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+    name_len = strlen(entry->d_name);
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    if (len + name_len + 2 > PATH_MAX) {
+      if (student->reason == NO_C_FILE)
+        student->reason = PATH_TOO_LONG;
+      continue;
+    }
+    if (is_directory(dirfd(dir), entry)) {
+      if ((sub_fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == ERROR)
         continue;
-      snprintf(path, sizeof(path), "%s/%s", name, entry->d_name);
-      check_subdirectories(student, path);
+      path[len] = '/';
+      memcpy(path + len + 1, entry->d_name, name_len + 1);
+      check_subdirectories(student, sub_fd, path, len + name_len + 1);
+      path[len] = '\0';
     } else {
       if (strcmp(get_filename_ext(entry->d_name, DOT), C_EXTENSION) != 0)
         continue;
+      free(student->file_path);
+      free(student->out_folder);
+      if (asprintf(&student->file_path, "%s/%s", path, entry->d_name) == ERROR || !(student->out_folder = strdup(path)))
+        error();
       student->reason = TBD;
-      strcpy(student->out_folder, name);
       strcpy(student->file_name, entry->d_name);
-      strcpy(student->file_path, name);
-      strcat(student->file_path, "/");
-      strcat(student->file_path, entry->d_name);
     }
-
   }
   if (closedir(dir) == ERROR)
     error();
 }
 
 /**
- * Check all subdirectories in main folder and make them as students.
+ * Shared state of the discovery workers, each walks the next student folder until none are left.
+ */
+typedef struct Walker {
+  Student *students;
+  int num_of_students;
+  int root_fd;
+  int next;
+} Walker;
+
+/**
+ * Discovery worker.
+ * @param arg   Walker shared by all workers.
+ * @return  NULL.
+ */
+void *walk_worker(void *arg) {
+  Walker *walker = (Walker *) arg;
+  char path[PATH_MAX];
+  Student *student;
+  int i, fd;
+  while ((i = __atomic_fetch_add(&walker->next, 1, __ATOMIC_RELAXED)) < walker->num_of_students) {
+    student = &walker->students[i];
+    if (strlen(student->folder_path) >= PATH_MAX) {
+      student->reason = PATH_TOO_LONG;
+      continue;
+    }
+    fd = openat(walker->root_fd, student->folder_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == ERROR)
+      continue;
+    strcpy(path, student->folder_path);
+    check_subdirectories(student, fd, path, strlen(path));
+  }
+  return NULL;
+}
+
+/**
+ * Check all subdirectories in main folder and make them as students. Student folders are walked
+ * on workers threads, which helps most on network file systems.
  * @param   location          Path to main director.
- * @param   num_of_students    Number of students to update.
+ * @param   num_of_students   Number of students to update.
+ * @param   workers           Number of threads walking the student folders.
  * @return  Dynamically allocated list of all students.
  */
-Student *check_directories(char *location, int *num_of_students) {
-  Student *students = malloc(sizeof(Student));
-  char *loc = calloc(sizeof(char), strlen(location) + 1);
-  if (!loc)
-    error();
-  strcpy(loc, location);
-  DIR *dir;
+Student *check_directories(char *location, int *num_of_students, int workers) {
+  Walker walker = {NULL, 0, ERROR, 0};
+  int capacity = 64, i;
+  Student *students = malloc(sizeof(Student) * capacity), *student;
   struct dirent *entry;
-  if (!(dir = opendir(location)))
+  pthread_t *threads;
+  DIR *dir;
+  if (!students)
+    error();
+  *num_of_students = 0;
+  if ((walker.root_fd = open(location, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == ERROR)
     return students;
+  if (!(dir = fdopendir(walker.root_fd)))
+    error();
   while ((entry = readdir(dir)) != NULL) {
-    if (entry->d_type == DT_DIR) {
-      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-        continue;
-      students = realloc(students, sizeof(*students) + sizeof(Student) * (*num_of_students));
-      students[*num_of_students].reason = TBD;
-      strcpy(students[*num_of_students].folder_name, entry->d_name);
-      strcpy(students[*num_of_students].folder_path, loc);
-      strcat(strcat(students[*num_of_students].folder_path, "/"), entry->d_name);
-      students[*num_of_students] = students[*num_of_students];
-      check_subdirectories(&students[*num_of_students], students[*num_of_students].folder_path);
-      (*num_of_students)++;
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 || !is_directory(dirfd(dir), entry))
+      continue;
+    if (*num_of_students == capacity) {
+      capacity *= 2;
+      if (!(students = realloc(students, sizeof(Student) * capacity)))
+        error();
     }
+    student = &students[*num_of_students];
+    memset(student, 0, sizeof(Student));
+    student->reason = NO_C_FILE; // Until a C file is found.
+    strcpy(student->folder_name, entry->d_name);
+    if (asprintf(&student->folder_path, "%s/%s", location, entry->d_name) == ERROR)
+      error();
+    (*num_of_students)++;
+  }
+
+  walker.students = students;
+  walker.num_of_students = *num_of_students;
+  if (workers > *num_of_students)
+    workers = *num_of_students;
+  if (workers <= 1) {
+    walk_worker(&walker);
+  } else {
+    if (!(threads = malloc(sizeof(pthread_t) * workers)))
+      error();
+    for (i = 0; i < workers; i++)
+      if (pthread_create(&threads[i], NULL, walk_worker, &walker) != 0)
+        error();
+    for (i = 0; i < workers; i++)
+      pthread_join(threads[i], NULL);
+    free(threads);
   }
   if (closedir(dir) == ERROR)
     error();
-  free(loc);
   return students;
 }
 
 /**
- * Parse the config file and save it as a struct.
+ * Parse the config file and save it as a struct. The first line is the students folder, then
+ * every line is a test, input,output[,weight] (weight 1 by default). A line without a comma is
+ * the old format: an input line followed by an output line. A path that doesn't fit or more than
+ * MAX_TESTS tests are an error, rather than grading against a cut path or fewer tests.
  * @param path_to_config    Path to the file
  * @param config            Config struct.
  */
 void parse_config(char *path_to_config, Config *config) {
   int fd;
-  int i = 0;
-  char buffer[MAX_LENGTH * NUM_OF_LINES] = {};
-  char tokens[NUM_OF_LINES][MAX_LENGTH] = {};
-  ssize_t num_bytes;
-  char *token;
+  struct stat st;
+  char *buffer;
+  ssize_t num_bytes, total = 0;
+  char *token, *save = NULL, *output, *weight;
+  Test *test;
   fd = open(path_to_config, O_RDONLY);
-  if (fd == ERROR)
+  if (fd == ERROR || fstat(fd, &st) == ERROR)
     error();
+  if (!(buffer = malloc(st.st_size + 1)))
+    error();
+
+  while (total < st.st_size && (num_bytes = read(fd, buffer + total, st.st_size - total)) > 0)
+    total += num_bytes;
+  if (total < st.st_size)
+    error();
+  buffer[total] = '\0';
+  close(fd);
 
-  num_bytes = read(fd, buffer, sizeof(buffer));
-  if (num_bytes == ERROR)
+  config->num_tests = 0;
+  if (!(token = strtok_r(buffer, NEW_LINE, &save)))
     error();
+  if (!copy_path(config->folders_location, token))
+    config_error("students folder path is too long");
+  while ((token = strtok_r(NULL, NEW_LINE, &save))) {
+    if (config->num_tests == MAX_TESTS)
+      config_error("too many tests");
+    test = &config->tests[config->num_tests];
+    test->weight = 1;
+    if ((output = strchr(token, *COMMA))) {
+      *output++ = '\0';
+      if ((weight = strchr(output, *COMMA))) {
+        *weight++ = '\0';
+        test->weight = atof(weight);
+      }
+    } else if (!(output = strtok_r(NULL, NEW_LINE, &save))) {
+      error();
+    }
+    if (!copy_path(test->input_file, token) || !copy_path(test->output_file, output))
+      config_error("test path is too long");
+    config->num_tests++;
+  }
+  free(buffer);
+  if (config->num_tests == 0)
+    error();
+}
+
+/**
+ * Copies a path to a MAX_LENGTH buffer.
+ * @param dest  Buffer to copy to.
+ * @param path  Path to copy.
+ * @return  True if copied, false if the path doesn't fit.
+ */
+bool copy_path(char *dest, const char *path) {
+  if (strlen(path) >= MAX_LENGTH)
+    return false;
+  strcpy(dest, path);
+  return true;
+}
 
-  token = strtok(buffer, NEW_LINE);
-  while (token != NULL) {
-    strcpy(tokens[i++], token);
-    token = strtok(NULL, NEW_LINE);
+/**
+ * Prints how long each phase took to stderr. Compiling, running and comparing are added up over
+ * the students, so with several workers they are longer than the grading itself.
+ * @param students          List of all students.
+ * @param num_of_students   Number of students in the list.
+ * @param config            Config struct.
+ * @param discovery_us      Time spent finding the students.
+ * @param write_us          Time spent writing the results.
+ * @param grade_us          Wall time of grading, from the first compiler to the last row.
+ */
+void print_timings(const Student *students, int num_of_students, const Config *config, long long discovery_us,
+                   long long write_us, long long grade_us) {
+  long long compile_ms = 0, run_us = 0, compare_us = 0;
+  int compiled = 0, cached = 0, reused = 0, runs = 0;
+  char note[ROW_SIZE];
+  for (int i = 0; i < num_of_students; i++) {
+    const Student *student = &students[i];
+    if (student->reused) {
+      reused++;
+      continue;
+    }
+    cached += student->cached;
+    compiled += !student->cached && student->compile_rss_kb > 0;
+    compile_ms += student->compile_ms;
+    run_us += student->run_us;
+    compare_us += student->compare_us;
+    runs += student->usage.measured ? config->num_tests : 0;
   }
-  strcpy(config->folders_location, tokens[0]);
-  strcpy(config->input_file, tokens[1]);
-  strcpy(config->output_file, tokens[2]);
+  snprintf(note, sizeof(note), "%d students, %d reused", num_of_students, reused);
+  fprintf(stderr, TIMING_FORMAT, "discovery", discovery_us / 1000.0, note);
+  snprintf(note, sizeof(note), "%d compiled, %d cached", compiled, cached);
+  fprintf(stderr, TIMING_FORMAT, "compile", (double) compile_ms, note);
+  snprintf(note, sizeof(note), "%d runs", runs);
+  fprintf(stderr, TIMING_FORMAT, "run", run_us / 1000.0, note);
+  fprintf(stderr, TIMING_FORMAT, "compare", compare_us / 1000.0, "cpu");
+  fprintf(stderr, TIMING_FORMAT, "output", write_us / 1000.0, config->json_file[0] ? "csv and json" : "csv");
+  fprintf(stderr, TIMING_FORMAT, "grade", grade_us / 1000.0, "wall");
 }
 
 /**
- * Main function.
- * @param   argc    Number of arguements (should be 2).
- * @param   argv    Path to configuration file.
+ * Main function, ex32 [-j workers] [-t seconds] config. Students are graded on workers threads
+ * (default one per core), each in its own directory under a temporary scratch root. A program
+ * running longer than the timeout (default TIMEOUT_SECONDS) is killed. Programs are started by a
+ * small runner process forked at startup, not by the grader itself. Compiled programs are
+ * cached in -c cache (default CACHE_DIR), so unchanged sources aren't compiled again, and verdicts
+ * are kept in -s state (default STATE_FILE), so only changed students or tests are graded again.
+ * -l cpu=s,mem=MB,fsize=MB,nproc=n limits every run, 0 for no limit (the cpu limit is always set,
+ * to the timeout by default). Up to -C compilers (default one per core) run at once, fewer under
+ * make -j, whose jobserver they share. Results go to -o csv (default DOT_RESULT_FILE) and, with -J json,
+ * to a JSON Lines file too, and -T prints how long each phase took. Output is compared in process,
+ * build with ex31.c:
+ * gcc -DCOMP_LIBRARY -pthread ex32.c ex31.c
+ * @param   argc    Number of arguements.
+ * @param   argv    Options and path to configuration file.
  * @return  Exit code
  */
 int main(int argc, char *argv[]) {
-  if (argc != 2)
+  static Config config;
+  int opt;
+  config.workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  config.timeout_ms = TIMEOUT_SECONDS * 1000;
+  strcpy(config.cache_dir, CACHE_DIR);
+  strcpy(config.state_file, STATE_FILE);
+  for (int i = 0; i < NUM_LIMITS; i++)
+    config.limits[i] = limit_defaults[i];
+  config.compilers = 0;
+  strcpy(config.csv_file, DOT_RESULT_FILE);
+  config.json_file[0] = '\0';
+  while ((opt = getopt(argc, argv, "C:c:J:j:l:o:s:Tt:")) != -1) {
+    switch (opt) {
+    case 'o':
+      if (!copy_path(config.csv_file, optarg))
+        config_error("results path is too long");
+      break;
+    case 'J':
+      if (!copy_path(config.json_file, optarg))
+        config_error("json path is too long");
+      break;
+    case 'T': config.timings = true;
+      break;
+    case 'C': config.compilers = atoi(optarg);
+      break;
+    case 'j': config.workers = atoi(optarg);
+      break;
+    case 't': config.timeout_ms = (int) (atof(optarg) * 1000);
+      break;
+    case 'c':
+      if (!copy_path(config.cache_dir, optarg))
+        config_error("cache path is too long");
+      break;
+    case 'l':
+      if (parse_limits(optarg, &config) == false)
+        return ERROR;
+      break;
+    case 's':
+      if (!copy_path(config.state_file, optarg))
+        config_error("state path is too long");
+      break;
+    default: return ERROR;
+    }
+  }
+  if (argc - optind != 1)
     return ERROR;
+  if (config.workers < 1)
+    config.workers = 1;
+  if (config.compilers < 1)
+    config.compilers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  config.jobserver = open_jobserver();
+  if (config.limits[LIMIT_CPU] == 0)
+    config.limits[LIMIT_CPU] = config.timeout_ms / 1000 + 1;
 
-  Config config;
-  parse_config(argv[1], &config);
+  parse_config(argv[optind], &config);
+  start_runner(&config);
+  strcpy(config.scratch_root, SCRATCH_DIR);
+  if (!mkdtemp(config.scratch_root))
+    error();
+  if (mkdir(config.cache_dir, 0755) == ERROR && errno != EEXIST)
+    error();
+  config.compiler_hash = compiler_hash();
+  // A verdict depends on the test and on how long and with what resources a program may run.
+  config.test_hash = hash_bytes(FNV_OFFSET, (const char *) &config.timeout_ms, sizeof(config.timeout_ms));
+  config.test_hash = hash_bytes(config.test_hash, (const char *) config.limits, sizeof(config.limits));
+  for (int t = 0; t < config.num_tests; t++) {
+    config.test_hash = hash_bytes(config.test_hash, (const char *) &config.tests[t].weight, sizeof(double));
+    hash_file(config.tests[t].input_file, &config.test_hash);
+    hash_file(config.tests[t].output_file, &config.test_hash);
+    if (!(config.tests[t].reference = comp_load_reference(config.tests[t].output_file)))
+      error();
+  }
+  load_state(&config);
 
   Student *students;
   int num_of_students = 0;
-  students = check_directories(config.folders_location, &num_of_students);
-
-  grade(students, num_of_students, config);
+  long long discovery_us = now_us(), grade_us;
+  students = check_directories(config.folders_location, &num_of_students, config.workers);
+  discovery_us = now_us() - discovery_us;
+  for (int i = 0; i < num_of_students; i++)
+    snprintf(students[i].scratch, MAX_LENGTH, "%s/%d", config.scratch_root, i);
 
-  save_CSV(students, num_of_students);
-  if (unlink(OUTPUT_FILE) == ERROR)
+  Sink sink;
+  sink_open(&sink, students, num_of_students, &config);
+  grade_us = now_us();
+  grade(students, num_of_students, config, &sink);
+  stop_runner(&config);
+  sink_close(&sink);
+  grade_us = now_us() - grade_us;
+  if (config.timings)
+    print_timings(students, num_of_students, &config, discovery_us, sink.write_us, grade_us);
+  save_state(students, num_of_students, &config);
+  free(config.results);
+  for (int t = 0; t < config.num_tests; t++)
+    comp_free_reference(config.tests[t].reference);
+  if (rmdir(config.scratch_root) == ERROR)
     error();
+  for (int i = 0; i < num_of_students; i++) {
+    free(students[i].folder_path);
+    free(students[i].file_path);
+    free(students[i].out_folder);
+  }
   free(students);
   return 0;
 }
@@ -0,0 +1,55 @@
+#!/bin/bash
+# Generates a synthetic corpus for ex32: gen_corpus.sh DIR [STUDENTS] [NUMBERS]
+# DIR gets students/, in.txt, out.txt and conf. Students cycle through correct, similar, wrong,
+# non-compiling, timing-out, nested, missing and long-output submissions. Every source is unique so
+# the compile cache doesn't merge them. NUMBERS is the length of the test input.
+DIR="$1"
+STUDENTS="${2:-200}"
+NUMBERS="${3:-1000}"
+KINDS=(correct similar wrong broken timeout nested missing long)
+if [ -z "$DIR" ]; then
+	echo "Usage: $0 DIR [STUDENTS] [NUMBERS]" >&2
+	exit 1
+fi
+mkdir -p "$DIR/students" || exit 1
+DIR=$(cd "$DIR" && pwd)
+
+# The test: print the square of every number of the input, one per line.
+seq 1 "$NUMBERS" > "$DIR/in.txt"
+awk '{ print $1 * $1 }' "$DIR/in.txt" > "$DIR/out.txt"
+printf '%s\n%s,%s\n' "$DIR/students" "$DIR/in.txt" "$DIR/out.txt" > "$DIR/conf"
+
+# Prints the source of student $1, which runs the statement $2 for every number n of the input.
+program() {
+	cat <<-END
+	// Student $1
+	#include <stdio.h>
+	int main() {
+	  long n;
+	  while (scanf("%ld", &n) == 1)
+	    $2;
+	  return 0;
+	}
+	END
+}
+
+for ((i = 0; i < STUDENTS; i++)); do
+	NAME=$(printf 'student%05d' "$i")
+	KIND=${KINDS[$((i % ${#KINDS[@]}))]}
+	FOLDER="$DIR/students/$NAME"
+	mkdir -p "$FOLDER"
+	case "$KIND" in
+	correct) program "$i" 'printf("%ld\n", n * n)' > "$FOLDER/main.c" ;;
+	similar) program "$i" 'printf("%ld ", n * n)' > "$FOLDER/main.c" ;;
+	wrong) program "$i" 'printf("%ld\n", n + n)' > "$FOLDER/main.c" ;;
+	broken) program "$i" 'printf("%ld\n", n * n' > "$FOLDER/main.c" ;;
+	timeout) program "$i" 'for (;;)' > "$FOLDER/main.c" ;;
+	nested)
+		mkdir -p "$FOLDER/src/app"
+		program "$i" 'printf("%ld\n", n * n)' > "$FOLDER/src/app/main.c"
+		;;
+	missing) echo "Student $i" > "$FOLDER/README" ;;
+	long) program "$i" 'printf("%ld\n", n * n); for (;;) puts("more")' > "$FOLDER/main.c" ;;
+	esac
+done
+echo "$DIR/conf"